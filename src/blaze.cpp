@@ -1,519 +1,291 @@
-#include <iomanip>
+#include <fstream>
 #include <iostream>
-#include <mutex>
 #include <sstream>
-#include <thread>
 #include <vector>
 
-#include <curl/curl.h>
-
 #include "argh.h"
-#include "../vendor/rapidjson/include/rapidjson/document.h"
-#include "../vendor/rapidjson/include/rapidjson/filewritestream.h"
-#include "../vendor/rapidjson/include/rapidjson/writer.h"
-
-#define DEFAULT_SIZE   5000
-#define DEFAULT_SLICES 5
-#define WRITE_BUF_SIZE 65536
-
-static std::mutex mtx_out;
-
-struct auth_options
-{
-    std::string type;
-    std::string user;
-    std::string pass;
-    bool insecure;
-};
-
-struct dump_options
-{
-    std::string  host;
-    std::string  index;
-    auth_options auth;
-    int          slice_id;
-    int          slice_max;
-    int          size;
-};
-
-struct thread_state
-{
-    std::stringstream error;
-};
-
-struct thread_container
-{
-    int          slice_id;
-    thread_state state;
-    std::thread  thread;
-};
-
-size_t write_data(
-    void   * buffer,
-    size_t   size,
-    size_t   nmemb,
-    void   * userp)
-{
-    std::vector<char>* data = reinterpret_cast<std::vector<char>*>(userp);
-
-    const char* real_buffer = reinterpret_cast<const char*>(buffer);
-    size_t real_size = size * nmemb;
-    data->insert(data->end(), real_buffer, real_buffer + real_size);
-    return real_size;
-}
+#include "libblaze.h"
+#include "serve.h"
 
-bool get_or_post_data(
-    CURL                * crl,
-    std::string   const & url,
-    auth_options  const & auth,
-    std::vector<char>   * data,
-    long                * response_code,
-    std::string         * error,
-    std::string           body = "")
+int main(
+    int    argc,
+    char * argv[])
 {
-    curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    curl_global_init(CURL_GLOBAL_ALL);
 
-    curl_easy_setopt(crl, CURLOPT_HTTPHEADER,    headers);
-    curl_easy_setopt(crl, CURLOPT_URL,           url.c_str());
-    curl_easy_setopt(crl, CURLOPT_WRITEFUNCTION, &write_data);
-    curl_easy_setopt(crl, CURLOPT_WRITEDATA,     reinterpret_cast<void*>(data));
+    // Parse command line options
+    argh::parser cmdl(argv);
 
-    if (auth.insecure)
-    {
-        curl_easy_setopt(crl, CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(crl, CURLOPT_SSL_VERIFYHOST, 0);
-    }
+    std::string convert;
 
-    if (auth.type == "basic")
+    if (cmdl({"--convert"}) >> convert)
     {
-        std::string user_pass = auth.user + ":" + auth.pass;
-        curl_easy_setopt(crl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
-        curl_easy_setopt(crl, CURLOPT_USERPWD,  user_pass.c_str());
+        return blaze::convert_dump(convert);
     }
 
-    if (!body.empty())
-    {
-        curl_easy_setopt(crl, CURLOPT_POSTFIELDS, body.c_str());
-    }
+    std::string lookup;
+    std::string extract;
 
-    CURLcode res = curl_easy_perform(crl);
-    curl_slist_free_all(headers);
+    bool has_lookup  = static_cast<bool>(cmdl({"--lookup"}) >> lookup);
+    bool has_extract = static_cast<bool>(cmdl({"--extract"}) >> extract);
 
-    if (res == CURLE_OK)
+    if (has_lookup || has_extract)
     {
-        curl_easy_getinfo(crl, CURLINFO_RESPONSE_CODE, response_code);
-        return true;
-    }
-
-    *error = curl_easy_strerror(res);
-    return false;
-}
-
-void write_document(
-    rapidjson::Document & document,
-    int                 * hits_count,
-    std::string         * scroll_id)
-{
-    std::unique_lock<std::mutex>      lock(mtx_out);
-
-    static char                       buffer[WRITE_BUF_SIZE];
-    static rapidjson::FileWriteStream stream(stdout, buffer, sizeof(buffer));
-
-    // Epic const unfolding.
-    auto const& scroll_id_value   = document["_scroll_id"];
-    auto const& hits_object_value = document["hits"];
-    auto const& hits_object       = hits_object_value.GetObject();
-    auto const& hits_value        = hits_object["hits"];
-    auto const& hits              = hits_value.GetArray();
+        std::string dump_path;
+        std::string sidecar_path;
 
-    // Shared allocator
-    auto& allocator               = document.GetAllocator();
-    auto  writer                  = rapidjson::Writer<rapidjson::FileWriteStream>(stream);
-
-    for (rapidjson::Value const& hit : hits)
-    {
-        auto meta_index      = rapidjson::Value(rapidjson::kObjectType);
-        auto meta_index_id   = rapidjson::Value();
-        auto meta_object     = rapidjson::Value(rapidjson::kObjectType);
+        if (!(cmdl({"--dump-file"}) >> dump_path) || !(cmdl({"--sidecar"}) >> sidecar_path))
+        {
+            std::cerr << "Must provide --dump-file and --sidecar when passing --lookup or --extract" << std::endl;
+            return 1;
+        }
 
-        meta_index_id.SetString(hit["_id"].GetString(), allocator);
+        std::vector<std::string> ids;
+        std::string              id;
+        std::stringstream        lookup_ids(lookup);
 
-        meta_index.AddMember("_id",   meta_index_id,   allocator);
+        while (std::getline(lookup_ids, id, ','))
+        {
+            ids.push_back(id);
+        }
 
-        meta_object.AddMember("index", meta_index, allocator);
+        if (has_extract)
+        {
+            std::ifstream extract_ids(extract);
 
-        // Serialize to output stream. Do it in two steps to get
-        // new-line separated JSON.
+            if (!extract_ids)
+            {
+                std::cerr << "Could not open " << extract << std::endl;
+                return 1;
+            }
 
-        meta_object.Accept(writer);
-        stream.Put('\n');
-        stream.Flush();
-        writer.Reset(stream);
+            while (std::getline(extract_ids, id))
+            {
+                if (!id.empty())
+                {
+                    ids.push_back(id);
+                }
+            }
+        }
 
-        hit["_source"].Accept(writer);
-        stream.Put('\n');
-        stream.Flush();
-        writer.Reset(stream);
+        return blaze::lookup_documents(dump_path, sidecar_path, ids);
     }
 
-    *scroll_id  = scroll_id_value.GetString();
-    *hits_count = hits.Size();
-}
+    if (cmdl[1] == "submit")
+    {
+        std::string                        socket_path;
+        std::map<std::string, std::string> args(cmdl.params());
 
-void output_parser_error(
-    rapidjson::Document const& doc,
-    std::ostream             & stream)
-{
-    stream << "JSON parsing failed with code: "
-           << doc.GetParseError()
-           << ", at offset "
-           << doc.GetErrorOffset();
-}
+        if (!(cmdl({"--socket"}) >> socket_path))
+        {
+            std::cerr << "Must provide --socket when running blaze submit" << std::endl;
+            return 1;
+        }
 
-void dump(
-    dump_options const& options,
-    thread_state      * state)
-{
-    CURL* crl = curl_easy_init();
-
-    std::string query = "{\n"
-        "\"size\": " + std::to_string(options.size) + ",\n"
-        "\"slice\": {\n"
-            "\"id\": " + std::to_string(options.slice_id) + ",\n"
-            "\"max\": " + std::to_string(options.slice_max) + "\n"
-        "}\n"
-    "}";
-
-    std::vector<char> buffer;
-    long              response_code;
-    std::string       error;
-
-    bool res = get_or_post_data(
-        crl,
-        options.host + "/" + options.index + "/_search?scroll=1m",
-        options.auth,
-        &buffer,
-        &response_code,
-        &error,
-        query);
-
-    if (!res)
-    {
-        state->error << "A HTTP error occured: " << error;
-        return;
-    }
+        args.erase("socket");
 
-    if (response_code != 200)
-    {
-        state->error << "Server returned HTTP status " << response_code << ": " << buffer.data();
-        return;
+        for (auto const& flag : cmdl.flags())
+        {
+            args[flag] = "true";
+        }
+
+        return submit(socket_path, args);
     }
 
-    rapidjson::Document doc;
-    doc.Parse(buffer.data(), buffer.size());
+    blaze::job_options    options;
+    blaze::output_options output;
 
-    if (doc.HasParseError())
+    std::string& host = options.host;
+    if (!(cmdl({"--host"}) >> host))
     {
-        return output_parser_error(doc, state->error);
+        std::cerr << "Must provide an Elasticsearch host (--host)" << std::endl;
+        return 1;
     }
 
-    std::string scroll_id;
-    int         hits_count;
-
-    write_document(
-        doc,
-        &hits_count,
-        &scroll_id);
+    blaze::auth_options& auth = options.auth;
 
-    do
+    if (cmdl({"--auth"}) >> auth.type)
     {
-        query = "{\n"
-            "\"scroll\": \"1m\",\n"
-            "\"scroll_id\": \"" + scroll_id + "\"\n"
-        "}\n";
-
-        buffer.clear();
-
-        res = get_or_post_data(
-            crl,
-            options.host + "/_search/scroll",
-            options.auth,
-            &buffer,
-            &response_code,
-            &error,
-            query);
-
-        if (!res)
+        if (auth.type == "basic")
         {
-            state->error << "A HTTP error occured: " << error;
-            return;
-        }
+            if (!(cmdl({"--basic-username"}) >> auth.user))
+            {
+                std::cerr << "Must provide --basic-username when passing --auth=basic" << std::endl;
+                return 1;
+            }
 
-        if (response_code != 200)
-        {
-            state->error << "Server returned HTTP status " << response_code;
-            return;
+            if (!(cmdl({"--basic-password"}) >> auth.pass))
+            {
+                std::cerr << "Must provide --basic-password when passing --auth=basic" << std::endl;
+                return 1;
+            }
         }
+    }
 
-        rapidjson::Document doc_search;
-        doc_search.Parse(buffer.data(), buffer.size());
+    auth.insecure = cmdl["--insecure"];
 
-        if (doc_search.HasParseError())
-        {
-            return output_parser_error(doc_search, state->error);
-        }
+    cmdl({"--max-docs-per-sec"}, 0) >> options.max_docs_per_sec;
+    cmdl({"--max-bytes-per-sec"}, 0) >> options.max_bytes_per_sec;
+    cmdl({"--max-inflight"}, 0) >> options.max_inflight;
 
-        write_document(
-            doc_search,
-            &hits_count,
-            &scroll_id);
-    } while (hits_count > 0);
+    options.adaptive_throttle = cmdl["--adaptive-throttle"];
 
-    curl_easy_cleanup(crl);
-}
+    cmdl({"--max-retries"}, DEFAULT_RETRIES) >> options.retry.max_retries;
+    cmdl({"--retry-delay"}, DEFAULT_RETRY_DELAY) >> options.retry.base_delay;
+    cmdl({"--retry-max-delay"}, DEFAULT_RETRY_MAX_DELAY) >> options.retry.max_delay;
+    cmdl({"--request-timeout"}, 0) >> options.retry.timeout;
 
-int64_t count_documents(
-    std::string  const& host,
-    std::string  const& index,
-    auth_options const& auth)
-{
-    CURL                * crl = curl_easy_init();
-    long                  response_code;
-    rapidjson::Document   doc;
-    std::string           url = host + "/" + index + "/_count";
-    std::string           error;
-    std::vector<char>     buffer;
-
-    bool res = get_or_post_data(
-        crl,
-        url,
-        auth,
-        &buffer,
-        &response_code,
-        &error);
-
-    if (!res)
+    if (cmdl[1] == "serve")
     {
-        std::cerr << "A HTTP error occured: " << error << std::endl;
-        return -1;
-    }
-
-    doc.Parse(buffer.data(), buffer.size());
+        std::string socket_path;
 
-    if (doc.HasParseError())
-    {
-        output_parser_error(doc, std::cerr);
-        return -1;
-    }
+        if (!(cmdl({"--socket"}) >> socket_path))
+        {
+            std::cerr << "Must provide --socket when running blaze serve" << std::endl;
+            return 1;
+        }
 
-    return doc["count"].GetInt64();
-}
+        cmdl({"--threads"}, DEFAULT_SLICES) >> options.threads;
 
-int dump_mappings(
-    std::string  const& host,
-    std::string  const& index,
-    auth_options const& auth)
-{
-    static char                       write_buffer[WRITE_BUF_SIZE];
-    static rapidjson::FileWriteStream stream(stdout, write_buffer, sizeof(write_buffer));
-
-    CURL                            * crl = curl_easy_init();
-    long                              response_code;
-    rapidjson::Document               doc;
-    std::string                       url = host + "/" + index + "/_mapping";
-    std::string                       error;
-    std::vector<char>                 buffer;
-
-    bool res = get_or_post_data(
-        crl,
-        url,
-        auth,
-        &buffer,
-        &response_code,
-        &error);
-
-    if (!res)
-    {
-        std::cerr << "A HTTP error occured: " << error << std::endl;
-        return 1;
+        return serve(socket_path, options);
     }
 
-    doc.Parse(buffer.data(), buffer.size());
+    cmdl({"--sidecar"}) >> output.sidecar;
 
-    if (doc.HasParseError())
-    {
-        output_parser_error(doc, std::cerr);
-        return 1;
-    }
+    output.checksum = static_cast<bool>(cmdl({"--manifest"}) >> options.manifest);
 
-    rapidjson::Writer<rapidjson::FileWriteStream> writer(stream);
-    doc[index.c_str()].Accept(writer);
-    stream.Put('\n');
-    stream.Flush();
+    options.verify = cmdl["--verify"];
 
-    curl_easy_cleanup(crl);
+    output.sorted = cmdl["--sorted"];
 
-    return 0;
-}
+    std::string format;
+    cmdl({"--format"}, "ndjson") >> format;
 
-int dump_index_info(
-    std::string  const& host,
-    std::string  const& index,
-    auth_options const& auth)
-{
-    static char                       write_buffer[WRITE_BUF_SIZE];
-    static rapidjson::FileWriteStream stream(stdout, write_buffer, sizeof(write_buffer));
-
-    CURL                            * crl = curl_easy_init();
-    long                              response_code;
-    rapidjson::Document               doc;
-    std::string                       url = host + "/" + index;
-    std::string                       error;
-    std::vector<char>                 buffer;
-
-    bool res = get_or_post_data(
-        crl,
-        url,
-        auth,
-        &buffer,
-        &response_code,
-        &error);
-
-    if (!res)
+    if (!blaze::parse_format(format, &output.format))
     {
-        std::cerr << "A HTTP error occured: " << error << std::endl;
+        std::cerr << "Unknown output format: " << format << std::endl;
         return 1;
     }
 
-    doc.Parse(buffer.data(), buffer.size());
+    std::string verify_path;
 
-    if (doc.HasParseError())
+    if (cmdl({"--verify-dump"}) >> verify_path)
     {
-        output_parser_error(doc, std::cerr);
-        return 1;
-    }
-
-    rapidjson::Writer<rapidjson::FileWriteStream> writer(stream);
-    doc[index.c_str()].Accept(writer);
-    stream.Put('\n');
-    stream.Flush();
-
-    curl_easy_cleanup(crl);
-
-    return 0;
-}
+        if (options.manifest.empty())
+        {
+            std::cerr << "Must provide --manifest when passing --verify-dump" << std::endl;
+            return 1;
+        }
 
-int main(
-    int    argc,
-    char * argv[])
-{
-    curl_global_init(CURL_GLOBAL_ALL);
+        cmdl({"--threads"}, 0) >> options.threads;
 
-    std::vector<std::unique_ptr<thread_container>> threads;
+        int exit_code = blaze::verify_dump(verify_path, options.manifest, options);
 
-    // Parse command line options
-    argh::parser cmdl(argv);
+        curl_global_cleanup();
 
-    std::string host;
-    if (!(cmdl({"--host"}) >> host))
-    {
-        std::cerr << "Must provide an Elasticsearch host (--host)" << std::endl;
-        return 1;
+        return exit_code;
     }
 
-    std::string index;
+    std::string& index = options.index;
     if (!(cmdl({"--index"}) >> index))
     {
         std::cerr << "Must provide an index (--index)" << std::endl;
         return 1;
     }
 
-    auth_options auth;
-
-    if (cmdl({"--auth"}) >> auth.type)
-    {
-        if (auth.type == "basic")
-        {
-            if (!(cmdl({"--basic-username"}) >> auth.user))
-            {
-                std::cerr << "Must provide --basic-username when passing --auth=basic" << std::endl;
-                return 1;
-            }
-
-            if (!(cmdl({"--basic-password"}) >> auth.pass))
-            {
-                std::cerr << "Must provide --basic-password when passing --auth=basic" << std::endl;
-                return 1;
-            }
-        }
-    }
-
-    auth.insecure = cmdl["--insecure"];
-
     if (cmdl["--dump-mappings"])
     {
-        return dump_mappings(
+        return blaze::dump_mappings(
             host,
             index,
             auth);
     }
     else if (cmdl["--dump-index-info"])
     {
-        return dump_index_info(
+        return blaze::dump_index_info(
             host,
             index,
             auth);
     }
 
-    // Sanity check - see if we have any documents in the index at all.
-    if (count_documents(host, index, auth) <= 0)
+    cmdl({"--slices"}, DEFAULT_SLICES) >> options.slices;
+    cmdl({"--size"}, DEFAULT_SIZE) >> options.size;
+    cmdl({"--threads"}, 0) >> options.threads;
+
+    cmdl({"--since-state"}) >> options.since_state;
+    cmdl({"--since-field"}, SEQ_NO_FIELD) >> options.since_field;
+
+    cmdl({"--sample"}) >> options.sample;
+    cmdl({"--sample-seed"}, 1) >> options.sample_seed;
+
+    double  sample_fraction;
+    int64_t sample_count;
+
+    if (!options.sample.empty() && !blaze::parse_sample(options.sample, &sample_fraction, &sample_count))
     {
-        std::cerr << "Index is empty - no documents found" << std::endl;
-        return 0;
+        std::cerr << "Invalid --sample: " << options.sample << std::endl;
+        return 1;
     }
 
-    int slices;
-    cmdl({"--slices"}, DEFAULT_SLICES) >> slices;
+    if (output.sorted)
+    {
+        cmdl({"--sort-memory"}, DEFAULT_SORT_MEMORY) >> output.sort_memory;
 
-    int size;
-    cmdl({"--size"}, DEFAULT_SIZE) >> size;
+        char const* tmp = getenv("TMPDIR");
+        cmdl({"--sort-dir"}, tmp != nullptr ? tmp : "/tmp") >> output.sort_dir;
+    }
 
-    for (int i = 0; i < slices; i++)
+    blaze::document_transform transform;
+    std::string               transform_path;
+
+    if (cmdl({"--transform"}) >> transform_path)
     {
-        dump_options opts;
-        opts.host      = host;
-        opts.index     = index;
-        opts.auth      = auth;
-        opts.size      = size;
-        opts.slice_id  = i;
-        opts.slice_max = slices;
-
-        auto cnt       = std::unique_ptr<thread_container>(new thread_container());
-        cnt->slice_id  = i;
-        cnt->thread    = std::thread(dump, opts, &cnt->state);
-
-        threads.push_back(std::move(cnt));
+        if (!transform.load(transform_path))
+        {
+            return 1;
+        }
+
+        options.transform = &transform;
     }
 
-    int exit_code = 0;
+    std::string partition_by;
 
-    for (auto& cnt : threads)
+    if (cmdl({"--partition-by"}) >> partition_by)
     {
-        cnt->thread.join();
-
-        if (cnt->state.error.tellp() > 0)
+        if (!output.sidecar.empty() || output.sorted || !options.manifest.empty())
         {
-            std::cerr << "Slice "
-                      << std::setw(2) << std::setfill('0') << cnt->slice_id
-                      << " exited with error: "
-                      << cnt->state.error.rdbuf()
-                      << std::endl;
+            std::cerr << "--partition-by can not be used with --sidecar, --sorted or --manifest" << std::endl;
+            return 1;
+        }
+
+        // The date format may itself contain colons, the field name may not.
+        blaze::partition_options partition;
+        size_t                   colon = partition_by.find(':');
 
-            exit_code = 1;
+        partition.field = partition_by.substr(0, colon);
+
+        if (colon != std::string::npos)
+        {
+            partition.date_format = partition_by.substr(colon + 1);
         }
+
+        cmdl({"--partition-dir"}, ".") >> partition.dir;
+        cmdl({"--max-open-files"}, DEFAULT_MAX_OPEN_FILES) >> partition.max_open_files;
+        cmdl({"--partition-memory"}, DEFAULT_PARTITION_MEM) >> partition.max_memory;
+
+        blaze::partition_sink sink(output, partition);
+
+        int exit_code = blaze::run_dump(options, &sink);
+
+        curl_global_cleanup();
+
+        return exit_code;
     }
 
+    blaze::output_sink sink(stdout, output);
+
+    int exit_code = blaze::run_dump(options, &sink);
+
     curl_global_cleanup();
 
     return exit_code;
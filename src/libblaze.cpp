@@ -0,0 +1,4496 @@
+#include "libblaze.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <random>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../vendor/rapidjson/include/rapidjson/filewritestream.h"
+#include "../vendor/rapidjson/include/rapidjson/stringbuffer.h"
+#include "../vendor/rapidjson/include/rapidjson/writer.h"
+
+#define WRITE_BUF_SIZE          65536
+#define SIDECAR_MAGIC           "BLZIDX1"
+#define BINARY_MAGIC            "BLZDUMP"
+#define PARTITION_BUF_SIZE      262144
+#define MERGE_FAN_IN            64
+#define MISSING_PARTITION       "_missing"
+#define EMPTY_PARTITION         "_empty"
+
+namespace blaze
+{
+
+// The sidecar file is this header followed by `count` entries sorted by
+// hash, in native byte order, so it can be mapped and binary searched.
+struct sidecar_header
+{
+    char     magic[8];
+    uint64_t count;
+};
+
+// High-water marks of an incremental dump, per index. Each mark is kept as
+// a JSON literal so it can be put straight back into a range query. Marks
+// on a timestamp field are keyed by the field name, marks on _seq_no by
+// shard number.
+typedef std::map<std::string, std::map<std::string, std::string>> since_state;
+
+// Hands out (index, slice) work units to a fixed pool of workers. Each
+// worker owns a deque and takes from its front. When it runs dry it steals
+// from the back of the other deques, so workers that finish their share
+// early pick up the small units left behind by the others.
+class work_scheduler
+{
+public:
+    explicit work_scheduler(size_t workers)
+        : queues_(workers)
+    {
+    }
+
+    void push(
+        size_t      worker,
+        work_unit * unit)
+    {
+        auto& q = queues_[worker % queues_.size()];
+        std::unique_lock<std::mutex> lock(q.mtx);
+        q.units.push_back(unit);
+    }
+
+    work_unit* next(size_t worker)
+    {
+        for (size_t i = 0; i < queues_.size(); i++)
+        {
+            auto& q = queues_[(worker + i) % queues_.size()];
+            std::unique_lock<std::mutex> lock(q.mtx);
+
+            if (q.units.empty())
+            {
+                continue;
+            }
+
+            work_unit* unit;
+
+            if (i == 0)
+            {
+                unit = q.units.front();
+                q.units.pop_front();
+            }
+            else
+            {
+                unit = q.units.back();
+                q.units.pop_back();
+            }
+
+            return unit;
+        }
+
+        return nullptr;
+    }
+
+private:
+    struct queue
+    {
+        std::mutex              mtx;
+        std::deque<work_unit *> units;
+    };
+
+    std::vector<queue> queues_;
+};
+
+bool parse_format(
+    std::string const& name,
+    int              * format)
+{
+    if (name == "ndjson")
+    {
+        *format = FORMAT_NDJSON;
+    }
+    else if (name == "cbor")
+    {
+        *format = FORMAT_CBOR;
+    }
+    else if (name == "msgpack")
+    {
+        *format = FORMAT_MSGPACK;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool parse_sample(
+    std::string const& text,
+    double           * fraction,
+    int64_t          * count)
+{
+    bool        percent = !text.empty() && text.back() == '%';
+    std::string number  = percent ? text.substr(0, text.size() - 1) : text;
+    char      * end     = nullptr;
+    double      value   = strtod(number.c_str(), &end);
+
+    // Also turns away NaN, which compares false to everything.
+    if (number.empty() || isspace(static_cast<unsigned char>(number[0])) || *end != '\0' || !(value > 0))
+    {
+        return false;
+    }
+
+    *fraction = 1;
+    *count    = 0;
+
+    if (percent)
+    {
+        *fraction = value / 100;
+        return value <= 100;
+    }
+
+    if (value < 1)
+    {
+        *fraction = value;
+        return true;
+    }
+
+    *count = static_cast<int64_t>(value);
+    return value <= 1e18 && static_cast<double>(*count) == value;
+}
+
+size_t write_data(
+    void   * buffer,
+    size_t   size,
+    size_t   nmemb,
+    void   * userp)
+{
+    std::vector<char>* data = reinterpret_cast<std::vector<char>*>(userp);
+
+    const char* real_buffer = reinterpret_cast<const char*>(buffer);
+    size_t real_size = size * nmemb;
+    data->insert(data->end(), real_buffer, real_buffer + real_size);
+    return real_size;
+}
+
+bool get_or_post_data(
+    CURL                * crl,
+    std::string   const & url,
+    auth_options  const & auth,
+    std::vector<char>   * data,
+    long                * response_code,
+    std::string         * error,
+    std::string           body,
+    char          const * method)
+{
+    curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    curl_easy_setopt(crl, CURLOPT_HTTPHEADER,    headers);
+    curl_easy_setopt(crl, CURLOPT_URL,           url.c_str());
+    curl_easy_setopt(crl, CURLOPT_WRITEFUNCTION, &write_data);
+    curl_easy_setopt(crl, CURLOPT_WRITEDATA,     reinterpret_cast<void*>(data));
+
+    if (auth.insecure)
+    {
+        curl_easy_setopt(crl, CURLOPT_SSL_VERIFYPEER, 0);
+        curl_easy_setopt(crl, CURLOPT_SSL_VERIFYHOST, 0);
+    }
+
+    if (auth.type == "basic")
+    {
+        std::string user_pass = auth.user + ":" + auth.pass;
+        curl_easy_setopt(crl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+        curl_easy_setopt(crl, CURLOPT_USERPWD,  user_pass.c_str());
+    }
+
+    if (!body.empty())
+    {
+        curl_easy_setopt(crl, CURLOPT_POSTFIELDS, body.c_str());
+    }
+    else
+    {
+        curl_easy_setopt(crl, CURLOPT_HTTPGET, 1L);
+    }
+
+    curl_easy_setopt(crl, CURLOPT_CUSTOMREQUEST, method);
+
+    CURLcode res = curl_easy_perform(crl);
+    curl_slist_free_all(headers);
+
+    if (res == CURLE_OK)
+    {
+        curl_easy_getinfo(crl, CURLINFO_RESPONSE_CODE, response_code);
+        return true;
+    }
+
+    *error = curl_easy_strerror(res);
+    return false;
+}
+
+uint64_t hash_id(
+    char   const* id,
+    size_t        length)
+{
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= static_cast<unsigned char>(id[i]);
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Binary dumps are a header followed by length prefixed records. Each
+// record is a CBOR or MessagePack map holding _index (when more than one
+// index is dumped), _id and _source. The 32-bit little-endian length in
+// front of every record lets readers skip or split the file without
+// decoding it.
+struct binary_header
+{
+    char    magic[7];
+    uint8_t format;
+};
+
+void put_be(
+    uint64_t      value,
+    int           bytes,
+    std::string * out)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        out->push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+    }
+}
+
+uint64_t double_bits(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+class binary_reader
+{
+public:
+    binary_reader(
+        uint8_t const* data,
+        size_t         size)
+        : data_(data),
+          size_(size),
+          pos_(0)
+    {
+    }
+
+    bool byte(uint8_t* value)
+    {
+        if (pos_ >= size_)
+        {
+            return false;
+        }
+
+        *value = data_[pos_++];
+        return true;
+    }
+
+    bool be(
+        int        bytes,
+        uint64_t * value)
+    {
+        if (size_ - pos_ < static_cast<size_t>(bytes))
+        {
+            return false;
+        }
+
+        *value = 0;
+
+        for (int i = 0; i < bytes; i++)
+        {
+            *value = (*value << 8) | data_[pos_++];
+        }
+
+        return true;
+    }
+
+    bool bytes(
+        uint64_t      length,
+        char const ** value)
+    {
+        if (size_ - pos_ < length)
+        {
+            return false;
+        }
+
+        *value = reinterpret_cast<char const*>(data_ + pos_);
+        pos_ += length;
+        return true;
+    }
+
+private:
+    uint8_t const* data_;
+    size_t         size_;
+    size_t         pos_;
+};
+
+typedef rapidjson::Writer<rapidjson::StringBuffer> json_writer;
+
+std::string to_json(rapidjson::Value const& value)
+{
+    rapidjson::StringBuffer                   buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    value.Accept(writer);
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+struct cbor_codec
+{
+    static void head(
+        uint8_t       major,
+        uint64_t      value,
+        std::string * out)
+    {
+        major <<= 5;
+
+        if (value < 24)
+        {
+            out->push_back(static_cast<char>(major | value));
+        }
+        else if (value <= 0xff)
+        {
+            out->push_back(static_cast<char>(major | 24));
+            put_be(value, 1, out);
+        }
+        else if (value <= 0xffff)
+        {
+            out->push_back(static_cast<char>(major | 25));
+            put_be(value, 2, out);
+        }
+        else if (value <= 0xffffffff)
+        {
+            out->push_back(static_cast<char>(major | 26));
+            put_be(value, 4, out);
+        }
+        else
+        {
+            out->push_back(static_cast<char>(major | 27));
+            put_be(value, 8, out);
+        }
+    }
+
+    static void write_map(
+        uint64_t      size,
+        std::string * out)
+    {
+        head(5, size, out);
+    }
+
+    static void write_string(
+        char const  * value,
+        size_t        length,
+        std::string * out)
+    {
+        head(3, length, out);
+        out->append(value, length);
+    }
+
+    static void write_value(
+        rapidjson::Value const& value,
+        std::string           * out)
+    {
+        switch (value.GetType())
+        {
+        case rapidjson::kNullType:  out->push_back(static_cast<char>(0xf6)); break;
+        case rapidjson::kFalseType: out->push_back(static_cast<char>(0xf4)); break;
+        case rapidjson::kTrueType:  out->push_back(static_cast<char>(0xf5)); break;
+        case rapidjson::kStringType:
+            write_string(value.GetString(), value.GetStringLength(), out);
+            break;
+        case rapidjson::kNumberType:
+            if (value.IsDouble())
+            {
+                out->push_back(static_cast<char>(0xfb));
+                put_be(double_bits(value.GetDouble()), 8, out);
+            }
+            else if (value.IsUint64())
+            {
+                head(0, value.GetUint64(), out);
+            }
+            else
+            {
+                head(1, static_cast<uint64_t>(-1 - value.GetInt64()), out);
+            }
+            break;
+        case rapidjson::kArrayType:
+            head(4, value.Size(), out);
+            for (auto const& item : value.GetArray())
+            {
+                write_value(item, out);
+            }
+            break;
+        case rapidjson::kObjectType:
+            write_map(value.MemberCount(), out);
+            for (auto const& member : value.GetObject())
+            {
+                write_string(member.name.GetString(), member.name.GetStringLength(), out);
+                write_value(member.value, out);
+            }
+            break;
+        }
+    }
+
+    static bool read_head(
+        binary_reader & in,
+        uint8_t       * major,
+        uint8_t       * info,
+        uint64_t      * value)
+    {
+        uint8_t initial;
+
+        if (!in.byte(&initial))
+        {
+            return false;
+        }
+
+        *major = initial >> 5;
+        *info  = initial & 0x1f;
+
+        if (*info < 24)
+        {
+            *value = *info;
+            return true;
+        }
+
+        if (*info > 27)
+        {
+            return false;
+        }
+
+        return in.be(1 << (*info - 24), value);
+    }
+
+    static bool read_map(
+        binary_reader & in,
+        uint64_t      * size)
+    {
+        uint8_t major, info;
+        return read_head(in, &major, &info, size) && major == 5;
+    }
+
+    static bool read_string(
+        binary_reader & in,
+        std::string   * value)
+    {
+        uint8_t     major, info;
+        uint64_t    length;
+        char const* data;
+
+        if (!read_head(in, &major, &info, &length) || major != 3 || !in.bytes(length, &data))
+        {
+            return false;
+        }
+
+        value->assign(data, length);
+        return true;
+    }
+
+    static bool read_value(
+        binary_reader & in,
+        json_writer   & writer)
+    {
+        uint8_t     major, info;
+        uint64_t    value;
+        char const* data;
+
+        if (!read_head(in, &major, &info, &value))
+        {
+            return false;
+        }
+
+        switch (major)
+        {
+        case 0: return writer.Uint64(value);
+        case 1: return writer.Int64(-1 - static_cast<int64_t>(value));
+        case 3: return in.bytes(value, &data) && writer.String(data, static_cast<rapidjson::SizeType>(value), true);
+        case 4:
+            writer.StartArray();
+            for (uint64_t i = 0; i < value; i++)
+            {
+                if (!read_value(in, writer)) return false;
+            }
+            return writer.EndArray(static_cast<rapidjson::SizeType>(value));
+        case 5:
+            writer.StartObject();
+            for (uint64_t i = 0; i < value; i++)
+            {
+                std::string key;
+                if (!read_string(in, &key)) return false;
+                writer.Key(key.data(), static_cast<rapidjson::SizeType>(key.size()), true);
+                if (!read_value(in, writer)) return false;
+            }
+            return writer.EndObject(static_cast<rapidjson::SizeType>(value));
+        case 7:
+            switch (info)
+            {
+            case 20: return writer.Bool(false);
+            case 21: return writer.Bool(true);
+            case 22: return writer.Null();
+            case 27:
+                double number;
+                memcpy(&number, &value, sizeof(number));
+                return writer.Double(number);
+            }
+        }
+
+        return false;
+    }
+};
+
+struct msgpack_codec
+{
+    static void write_map(
+        uint64_t      size,
+        std::string * out)
+    {
+        if (size < 16)            { out->push_back(static_cast<char>(0x80 | size)); }
+        else if (size <= 0xffff)  { out->push_back(static_cast<char>(0xde)); put_be(size, 2, out); }
+        else                      { out->push_back(static_cast<char>(0xdf)); put_be(size, 4, out); }
+    }
+
+    static void write_string(
+        char const  * value,
+        size_t        length,
+        std::string * out)
+    {
+        if (length < 32)            { out->push_back(static_cast<char>(0xa0 | length)); }
+        else if (length <= 0xff)    { out->push_back(static_cast<char>(0xd9)); put_be(length, 1, out); }
+        else if (length <= 0xffff)  { out->push_back(static_cast<char>(0xda)); put_be(length, 2, out); }
+        else                        { out->push_back(static_cast<char>(0xdb)); put_be(length, 4, out); }
+
+        out->append(value, length);
+    }
+
+    static void write_value(
+        rapidjson::Value const& value,
+        std::string           * out)
+    {
+        switch (value.GetType())
+        {
+        case rapidjson::kNullType:  out->push_back(static_cast<char>(0xc0)); break;
+        case rapidjson::kFalseType: out->push_back(static_cast<char>(0xc2)); break;
+        case rapidjson::kTrueType:  out->push_back(static_cast<char>(0xc3)); break;
+        case rapidjson::kStringType:
+            write_string(value.GetString(), value.GetStringLength(), out);
+            break;
+        case rapidjson::kNumberType:
+            if (value.IsDouble())
+            {
+                out->push_back(static_cast<char>(0xcb));
+                put_be(double_bits(value.GetDouble()), 8, out);
+            }
+            else if (value.IsUint64())
+            {
+                uint64_t number = value.GetUint64();
+
+                if (number < 128)               { out->push_back(static_cast<char>(number)); }
+                else if (number <= 0xff)        { out->push_back(static_cast<char>(0xcc)); put_be(number, 1, out); }
+                else if (number <= 0xffff)      { out->push_back(static_cast<char>(0xcd)); put_be(number, 2, out); }
+                else if (number <= 0xffffffff)  { out->push_back(static_cast<char>(0xce)); put_be(number, 4, out); }
+                else                            { out->push_back(static_cast<char>(0xcf)); put_be(number, 8, out); }
+            }
+            else
+            {
+                int64_t number = value.GetInt64();
+
+                if (number >= -32)              { out->push_back(static_cast<char>(number)); }
+                else if (number >= INT8_MIN)    { out->push_back(static_cast<char>(0xd0)); put_be(number, 1, out); }
+                else if (number >= INT16_MIN)   { out->push_back(static_cast<char>(0xd1)); put_be(number, 2, out); }
+                else if (number >= INT32_MIN)   { out->push_back(static_cast<char>(0xd2)); put_be(number, 4, out); }
+                else                            { out->push_back(static_cast<char>(0xd3)); put_be(number, 8, out); }
+            }
+            break;
+        case rapidjson::kArrayType:
+            if (value.Size() < 16)            { out->push_back(static_cast<char>(0x90 | value.Size())); }
+            else if (value.Size() <= 0xffff)  { out->push_back(static_cast<char>(0xdc)); put_be(value.Size(), 2, out); }
+            else                              { out->push_back(static_cast<char>(0xdd)); put_be(value.Size(), 4, out); }
+            for (auto const& item : value.GetArray())
+            {
+                write_value(item, out);
+            }
+            break;
+        case rapidjson::kObjectType:
+            write_map(value.MemberCount(), out);
+            for (auto const& member : value.GetObject())
+            {
+                write_string(member.name.GetString(), member.name.GetStringLength(), out);
+                write_value(member.value, out);
+            }
+            break;
+        }
+    }
+
+    static bool read_map(
+        binary_reader & in,
+        uint64_t      * size)
+    {
+        uint8_t type;
+
+        if (!in.byte(&type))
+        {
+            return false;
+        }
+
+        if ((type & 0xf0) == 0x80)
+        {
+            *size = type & 0x0f;
+            return true;
+        }
+
+        return (type == 0xde && in.be(2, size)) || (type == 0xdf && in.be(4, size));
+    }
+
+    static bool read_string(
+        binary_reader & in,
+        std::string   * value)
+    {
+        uint8_t     type;
+        uint64_t    length;
+        char const* data;
+
+        if (!in.byte(&type) || !read_string_length(in, type, &length) || !in.bytes(length, &data))
+        {
+            return false;
+        }
+
+        value->assign(data, length);
+        return true;
+    }
+
+    static bool read_string_length(
+        binary_reader & in,
+        uint8_t         type,
+        uint64_t      * length)
+    {
+        if ((type & 0xe0) == 0xa0)
+        {
+            *length = type & 0x1f;
+            return true;
+        }
+
+        return (type == 0xd9 && in.be(1, length))
+            || (type == 0xda && in.be(2, length))
+            || (type == 0xdb && in.be(4, length));
+    }
+
+    static bool read_value(
+        binary_reader & in,
+        json_writer   & writer)
+    {
+        uint8_t     type;
+        uint64_t    value;
+        uint64_t    count;
+        char const* data;
+
+        if (!in.byte(&type))
+        {
+            return false;
+        }
+
+        if (type < 0x80)
+        {
+            return writer.Uint(type);
+        }
+
+        if (type >= 0xe0)
+        {
+            return writer.Int(static_cast<int8_t>(type));
+        }
+
+        if (read_string_length(in, type, &count))
+        {
+            return in.bytes(count, &data) && writer.String(data, static_cast<rapidjson::SizeType>(count), true);
+        }
+
+        if ((type & 0xf0) == 0x90 || type == 0xdc || type == 0xdd)
+        {
+            if ((type & 0xf0) == 0x90)  { count = type & 0x0f; }
+            else if (!in.be(type == 0xdc ? 2 : 4, &count)) { return false; }
+
+            writer.StartArray();
+            for (uint64_t i = 0; i < count; i++)
+            {
+                if (!read_value(in, writer)) return false;
+            }
+            return writer.EndArray(static_cast<rapidjson::SizeType>(count));
+        }
+
+        if ((type & 0xf0) == 0x80 || type == 0xde || type == 0xdf)
+        {
+            if ((type & 0xf0) == 0x80)  { count = type & 0x0f; }
+            else if (!in.be(type == 0xde ? 2 : 4, &count)) { return false; }
+
+            writer.StartObject();
+            for (uint64_t i = 0; i < count; i++)
+            {
+                std::string key;
+                if (!read_string(in, &key)) return false;
+                writer.Key(key.data(), static_cast<rapidjson::SizeType>(key.size()), true);
+                if (!read_value(in, writer)) return false;
+            }
+            return writer.EndObject(static_cast<rapidjson::SizeType>(count));
+        }
+
+        switch (type)
+        {
+        case 0xc0: return writer.Null();
+        case 0xc2: return writer.Bool(false);
+        case 0xc3: return writer.Bool(true);
+        case 0xcc: return in.be(1, &value) && writer.Uint64(value);
+        case 0xcd: return in.be(2, &value) && writer.Uint64(value);
+        case 0xce: return in.be(4, &value) && writer.Uint64(value);
+        case 0xcf: return in.be(8, &value) && writer.Uint64(value);
+        case 0xd0: return in.be(1, &value) && writer.Int64(static_cast<int8_t>(value));
+        case 0xd1: return in.be(2, &value) && writer.Int64(static_cast<int16_t>(value));
+        case 0xd2: return in.be(4, &value) && writer.Int64(static_cast<int32_t>(value));
+        case 0xd3: return in.be(8, &value) && writer.Int64(static_cast<int64_t>(value));
+        case 0xcb:
+            if (!in.be(8, &value)) return false;
+            double number;
+            memcpy(&number, &value, sizeof(number));
+            return writer.Double(number);
+        }
+
+        return false;
+    }
+};
+
+template<typename Codec>
+void encode_record(
+    rapidjson::Value const& hit,
+    bool                    include_index,
+    bool                    include_routing,
+    std::string           * out)
+{
+    size_t start = out->size();
+    out->append(4, '\0');
+
+    include_routing = include_routing && hit.HasMember("_routing");
+
+    Codec::write_map(2 + include_index + include_routing, out);
+
+    if (include_index)
+    {
+        auto const& index = hit["_index"];
+        Codec::write_string("_index", 6, out);
+        Codec::write_string(index.GetString(), index.GetStringLength(), out);
+    }
+
+    auto const& id = hit["_id"];
+    Codec::write_string("_id", 3, out);
+    Codec::write_string(id.GetString(), id.GetStringLength(), out);
+
+    if (include_routing)
+    {
+        auto const& routing = hit["_routing"];
+        Codec::write_string("routing", 7, out);
+        Codec::write_string(routing.GetString(), routing.GetStringLength(), out);
+    }
+
+    Codec::write_string("_source", 7, out);
+    Codec::write_value(hit["_source"], out);
+
+    uint32_t length = static_cast<uint32_t>(out->size() - start - 4);
+
+    for (int i = 0; i < 4; i++)
+    {
+        (*out)[start + i] = static_cast<char>((length >> (i * 8)) & 0xff);
+    }
+}
+
+// Decodes one record payload into the two lines of a bulk request.
+template<typename Codec>
+bool decode_record(
+    uint8_t const* data,
+    size_t         size,
+    std::string  * action,
+    std::string  * source)
+{
+    binary_reader           in(data, size);
+    uint64_t                members;
+    std::string             index;
+    std::string             id;
+    std::string             routing;
+    rapidjson::StringBuffer source_buffer;
+    json_writer             source_writer(source_buffer);
+
+    if (!Codec::read_map(in, &members))
+    {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < members; i++)
+    {
+        std::string key;
+
+        if (!Codec::read_string(in, &key))
+        {
+            return false;
+        }
+
+        bool ok = key == "_index"  ? Codec::read_string(in, &index)
+                : key == "_id"     ? Codec::read_string(in, &id)
+                : key == "routing" ? Codec::read_string(in, &routing)
+                : key == "_source" ? Codec::read_value(in, source_writer)
+                : false;
+
+        if (!ok)
+        {
+            return false;
+        }
+    }
+
+    rapidjson::StringBuffer action_buffer;
+    json_writer             action_writer(action_buffer);
+
+    action_writer.StartObject();
+    action_writer.Key("index");
+    action_writer.StartObject();
+
+    if (!index.empty())
+    {
+        action_writer.Key("_index");
+        action_writer.String(index.data(), static_cast<rapidjson::SizeType>(index.size()));
+    }
+
+    action_writer.Key("_id");
+    action_writer.String(id.data(), static_cast<rapidjson::SizeType>(id.size()));
+
+    if (!routing.empty())
+    {
+        action_writer.Key("routing");
+        action_writer.String(routing.data(), static_cast<rapidjson::SizeType>(routing.size()));
+    }
+
+    action_writer.EndObject();
+    action_writer.EndObject();
+
+    action->assign(action_buffer.GetString(), action_buffer.GetSize());
+    source->assign(source_buffer.GetString(), source_buffer.GetSize());
+
+    return true;
+}
+
+bool decode_record(
+    int            format,
+    uint8_t const* data,
+    size_t         size,
+    std::string  * action,
+    std::string  * source)
+{
+    return format == FORMAT_CBOR
+        ? decode_record<cbor_codec>(data, size, action, source)
+        : decode_record<msgpack_codec>(data, size, action, source);
+}
+
+// Reads the header of a dump. NDJSON dumps have none and are left at the
+// start of the stream.
+bool read_dump_header(
+    std::istream & in,
+    int          * format)
+{
+    binary_header header;
+
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+    if (in.gcount() == sizeof(header)
+        && std::equal(header.magic, header.magic + sizeof(header.magic), BINARY_MAGIC)
+        && (header.format == FORMAT_CBOR || header.format == FORMAT_MSGPACK))
+    {
+        *format = header.format;
+        return true;
+    }
+
+    in.clear();
+    in.seekg(0);
+
+    *format = FORMAT_NDJSON;
+    return true;
+}
+
+uint32_t record_length(uint8_t const* prefix)
+{
+    return prefix[0]
+        | (prefix[1] << 8)
+        | (prefix[2] << 16)
+        | (static_cast<uint32_t>(prefix[3]) << 24);
+}
+
+// Reads the length prefixed record at the current position of a binary
+// dump. Returns false at the end of the file.
+bool read_record(
+    std::istream         & in,
+    std::vector<uint8_t> * record)
+{
+    uint8_t prefix[4];
+
+    if (!in.read(reinterpret_cast<char*>(prefix), sizeof(prefix)))
+    {
+        return false;
+    }
+
+    uint32_t length = record_length(prefix);
+
+    record->resize(length);
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(record->data()), length));
+}
+
+// Converts a binary dump back to NDJSON in the bulk format.
+int convert_dump(std::string const& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    int           format;
+
+    if (!in || !read_dump_header(in, &format) || format == FORMAT_NDJSON)
+    {
+        std::cerr << "Not a binary dump: " << path << std::endl;
+        return 1;
+    }
+
+    std::vector<uint8_t> record;
+    std::string          action;
+    std::string          source;
+
+    while (read_record(in, &record))
+    {
+        if (!decode_record(format, record.data(), record.size(), &action, &source))
+        {
+            std::cerr << "Corrupt record in " << path << std::endl;
+            return 1;
+        }
+
+        std::cout << action << '\n' << source << '\n';
+    }
+
+    return 0;
+}
+
+void add_sort_record(
+    sort_run          * run,
+    char        const * index,
+    std::string const & id,
+    char        const * data,
+    size_t              length)
+{
+    sort_run::entry entry;
+    entry.key        = run->arena.size();
+    entry.key_length = static_cast<uint32_t>(strlen(index) + 1 + id.size());
+    entry.length     = static_cast<uint32_t>(length);
+
+    // Sort by index first, so documents with the same _id in different
+    // indices still have a fixed order.
+    run->arena.append(index);
+    run->arena.push_back('\0');
+    run->arena.append(id);
+    run->arena.append(data, length);
+    run->entries.push_back(entry);
+}
+
+void write_u32(
+    uint32_t value,
+    FILE   * file)
+{
+    uint8_t bytes[4] = {
+        static_cast<uint8_t>(value),
+        static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value >> 16),
+        static_cast<uint8_t>(value >> 24)
+    };
+
+    fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+void write_block(
+    char const* data,
+    uint32_t    length,
+    FILE      * file)
+{
+    write_u32(length, file);
+    fwrite(data, 1, length, file);
+}
+
+// Creates an empty temporary run file in `dir`.
+FILE* create_run(
+    std::string const& dir,
+    std::string      * path)
+{
+    *path  = dir + "/blaze-run-XXXXXX";
+    int fd = mkstemp(&(*path)[0]);
+
+    return fd < 0 ? nullptr : fdopen(fd, "wb");
+}
+
+// Reads runs back one record at a time for the merge.
+class run_reader
+{
+public:
+    explicit run_reader(std::string const& path)
+        : file_(fopen(path.c_str(), "rb")),
+          buffer_(WRITE_BUF_SIZE)
+    {
+        if (file_ != nullptr)
+        {
+            setvbuf(file_, buffer_.data(), _IOFBF, buffer_.size());
+        }
+    }
+
+    ~run_reader()
+    {
+        if (file_ != nullptr)
+        {
+            fclose(file_);
+        }
+    }
+
+    bool good() const
+    {
+        return file_ != nullptr && !ferror(file_);
+    }
+
+    bool next()
+    {
+        return file_ != nullptr
+            && read_block(&key)
+            && read_block(&record);
+    }
+
+    std::string key;
+    std::string record;
+
+private:
+    bool read_block(std::string* block)
+    {
+        uint8_t prefix[4];
+
+        if (fread(prefix, 1, sizeof(prefix), file_) != sizeof(prefix))
+        {
+            return false;
+        }
+
+        block->resize(record_length(prefix));
+
+        return fread(&(*block)[0], 1, block->size(), file_) == block->size();
+    }
+
+    FILE*             file_;
+    std::vector<char> buffer_;
+};
+
+// Takes up to `wanted` documents from a unit's budget, and once that is
+// spent from the spare documents shared by all units, returning how many
+// may be written.
+int64_t take_budget(
+    int64_t              * budget,
+    std::atomic<int64_t> * spare,
+    int64_t                wanted)
+{
+    int64_t taken = std::max<int64_t>(0, std::min(*budget, wanted));
+    *budget -= taken;
+    wanted  -= taken;
+
+    int64_t left = spare->load();
+
+    while (wanted > 0 && left > 0 && !spare->compare_exchange_weak(left, left - std::min(left, wanted)))
+    {
+    }
+
+    return taken + std::max<int64_t>(0, std::min(left, wanted));
+}
+
+void write_document(
+    rapidjson::Document & document,
+    dump_options  const & options,
+    thread_state        * state,
+    int                 * hits_count)
+{
+    // Epic const unfolding.
+    auto const& hits_object_value = document["hits"];
+    auto const& hits_object       = hits_object_value.GetObject();
+    auto const& hits_value        = hits_object["hits"];
+    auto const& hits              = hits_value.GetArray();
+
+    rapidjson::SizeType count = hits.Size();
+
+    if (options.sample_budget != nullptr)
+    {
+        count = static_cast<rapidjson::SizeType>(take_budget(options.sample_budget, options.sample_spare, count));
+    }
+
+    *hits_count = count;
+
+    // Transforms run on the slice threads, rewriting the page in place.
+    if (options.transform != nullptr)
+    {
+        auto& page = document["hits"]["hits"];
+
+        for (rapidjson::SizeType i = 0; i < count; i++)
+        {
+            options.transform->apply(page[i], document.GetAllocator());
+        }
+    }
+
+    options.sink->write_page(hits.begin(), count, options, state);
+
+    state->documents += count;
+}
+
+void output_parser_error(
+    rapidjson::Document const& doc,
+    std::ostream             & stream)
+{
+    stream << "JSON parsing failed with code: "
+           << doc.GetParseError()
+           << ", at offset "
+           << doc.GetErrorOffset();
+}
+
+// Total number of hits reported by a search response, or -1 when it is
+// only a lower bound.
+int64_t total_hits(rapidjson::Document const& doc)
+{
+    // Elasticsearch 7 reports { "value": n, "relation": "eq" }, older
+    // versions a number.
+    auto const& total = doc["hits"]["total"];
+
+    if (!total.IsObject())
+    {
+        return total.GetInt64();
+    }
+
+    if (total.HasMember("relation") && std::string(total["relation"].GetString()) != "eq")
+    {
+        return -1;
+    }
+
+    return total["value"].GetInt64();
+}
+
+// Exponential backoff with full jitter, in milliseconds.
+long retry_delay(
+    retry_options const& retry,
+    int                  attempt)
+{
+    static thread_local std::mt19937 rng(std::random_device{}());
+
+    long ceiling = retry.base_delay << std::min(attempt, 20);
+    ceiling      = std::min(ceiling, retry.max_delay);
+
+    return std::uniform_int_distribution<long>(0, ceiling)(rng);
+}
+
+// Runs a search or scroll request and parses the response, going through
+// the rate limiter when there is one. Transport errors, timeouts and
+// HTTP 429, 502, 503 and 504 are retried with backoff.
+//
+// A scroll request can not be replayed: if a failed one did reach the
+// cluster, its page is gone and a retry returns the next one. So unless
+// `replayable`, only failures that surely did not get there are retried,
+// an error before anything was sent or a 429, and any other failure ends
+// the slice right away rather than dumping it with a page missing.
+bool fetch_page(
+    CURL                * crl,
+    dump_options  const & options,
+    std::string   const & url,
+    std::string   const & query,
+    bool                  replayable,
+    rapidjson::Document * doc,
+    thread_state        * state,
+    char          const * method = nullptr)
+{
+    std::vector<char> buffer;
+    long              response_code = 0;
+    std::string       error;
+    bool              res;
+
+    for (int attempt = 0; ; attempt++)
+    {
+        buffer.clear();
+
+        if (options.limiter != nullptr)
+        {
+            options.limiter->acquire();
+        }
+
+        res = get_or_post_data(
+            crl,
+            url,
+            options.auth,
+            &buffer,
+            &response_code,
+            &error,
+            query,
+            method);
+
+        bool ok = res && response_code == 200;
+
+        if (ok)
+        {
+            doc->Parse(buffer.data(), buffer.size());
+            ok = !doc->HasParseError();
+        }
+
+        if (options.limiter != nullptr)
+        {
+            bool page = ok && doc->IsObject() && doc->HasMember("hits") && doc->HasMember("took");
+
+            options.limiter->release(
+                page ? (*doc)["hits"]["hits"].Size() : 0,
+                buffer.size(),
+                page ? (*doc)["took"].GetInt64() : 0,
+                res ? response_code : 0);
+        }
+
+        bool retryable = !res
+            || response_code == 429
+            || response_code == 502
+            || response_code == 503
+            || response_code == 504;
+
+        if (!retryable || attempt >= options.retry.max_retries)
+        {
+            break;
+        }
+
+        long sent = 0;
+        curl_easy_getinfo(crl, CURLINFO_REQUEST_SIZE, &sent);
+
+        if (!replayable && (res ? response_code != 429 : sent > 0))
+        {
+            state->error << "A scroll request failed after it may have reached the cluster, "
+                         << "retrying it could skip a page: "
+                         << (res ? "HTTP status " + std::to_string(response_code) : error);
+            return false;
+        }
+
+        state->retries++;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(retry_delay(options.retry, attempt)));
+    }
+
+    if (!res)
+    {
+        state->error << "A HTTP error occured: " << error;
+        return false;
+    }
+
+    if (response_code != 200)
+    {
+        state->error << "Server returned HTTP status " << response_code << ": " << std::string(buffer.begin(), buffer.end());
+        return false;
+    }
+
+    if (doc->HasParseError())
+    {
+        output_parser_error(*doc, state->error);
+        return false;
+    }
+
+    return true;
+}
+
+void clear_scroll(
+    CURL               * crl,
+    dump_options const & options,
+    std::string  const & scroll_id)
+{
+    std::vector<char> buffer;
+    long              response_code;
+    std::string       error;
+
+    get_or_post_data(
+        crl,
+        options.host + "/_search/scroll",
+        options.auth,
+        &buffer,
+        &response_code,
+        &error,
+        "{ \"scroll_id\": \"" + scroll_id + "\" }",
+        "DELETE");
+}
+
+void close_point_in_time(
+    CURL               * crl,
+    dump_options const & options,
+    std::string  const & pit_id)
+{
+    std::vector<char> buffer;
+    long              response_code;
+    std::string       error;
+
+    get_or_post_data(
+        crl,
+        options.host + "/_pit",
+        options.auth,
+        &buffer,
+        &response_code,
+        &error,
+        "{ \"id\": \"" + pit_id + "\" }",
+        "DELETE");
+}
+
+// The size, query and slice of the search of a unit, as a JSON object
+// left open for more members.
+std::string search_body(dump_options const& options)
+{
+    std::string query = "{\n"
+        "\"size\": " + std::to_string(options.size);
+
+    if (!options.filter.empty())
+    {
+        query += ",\n"
+        "\"query\": " + options.filter;
+    }
+
+    // Elasticsearch rejects slicing with max = 1, so small indices
+    // scheduled as a single unit are searched without a slice.
+    if (options.slice_max > 1)
+    {
+        query += ",\n"
+        "\"slice\": {\n"
+            "\"id\": " + std::to_string(options.slice_id) + ",\n"
+            "\"max\": " + std::to_string(options.slice_max) + "\n"
+        "}";
+    }
+
+    return query;
+}
+
+void dump_scroll(
+    CURL               * crl,
+    dump_options const & options,
+    thread_state       * state)
+{
+    rapidjson::Document doc;
+
+    if (!fetch_page(
+        crl,
+        options,
+        options.host + "/" + options.index + "/_search?scroll=1m" + options.preference,
+        search_body(options) + "\n}",
+        true,
+        &doc,
+        state))
+    {
+        return;
+    }
+
+    // Scroll requests are never retried once they may have reached the
+    // cluster, still hold the slice to the total the scroll started out
+    // with when the cluster reports an exact one.
+    int64_t expected = total_hits(doc);
+
+    std::string scroll_id = doc["_scroll_id"].GetString();
+    int         hits_count;
+    bool        ok = true;
+
+    write_document(
+        doc,
+        options,
+        state,
+        &hits_count);
+
+    do
+    {
+        std::string query = "{\n"
+            "\"scroll\": \"1m\",\n"
+            "\"scroll_id\": \"" + scroll_id + "\"\n"
+        "}\n";
+
+        rapidjson::Document doc_search;
+
+        if (!fetch_page(
+            crl,
+            options,
+            options.host + "/_search/scroll",
+            query,
+            false,
+            &doc_search,
+            state))
+        {
+            ok = false;
+            break;
+        }
+
+        scroll_id = doc_search["_scroll_id"].GetString();
+
+        write_document(
+            doc_search,
+            options,
+            state,
+            &hits_count);
+    } while (hits_count > 0);
+
+    // Free the scroll context now rather than when it times out, a sample
+    // may well have stopped before the end, and a failed slice never gets
+    // there.
+    clear_scroll(crl, options, scroll_id);
+
+    if (ok && options.sample_budget == nullptr && expected >= 0 && state->documents != expected)
+    {
+        state->error << "Scroll ended after " << state->documents << " of " << expected << " documents";
+    }
+}
+
+// Pages through a unit with a point in time and search_after. Every page
+// is asked for by the sort values of the last hit before it, so unlike a
+// scroll page it can be fetched again, and all requests are retried.
+void dump_point_in_time(
+    CURL               * crl,
+    dump_options const & options,
+    thread_state       * state)
+{
+    rapidjson::Document doc;
+
+    if (!fetch_page(
+        crl,
+        options,
+        options.host + "/" + options.index + "/_pit?keep_alive=1m" + options.preference,
+        "",
+        true,
+        &doc,
+        state,
+        "POST"))
+    {
+        return;
+    }
+
+    if (!doc.IsObject() || !doc.HasMember("id") || !doc["id"].IsString())
+    {
+        state->error << "Could not open a point in time on " << options.index;
+        return;
+    }
+
+    std::string pit_id = doc["id"].GetString();
+    std::string search_after;
+    int64_t     expected = -1;
+    int         hits_count;
+    bool        ok = true;
+
+    do
+    {
+        // Only the first page counts the hits, exactly, for the check at
+        // the end.
+        std::string query = search_body(options) + ",\n"
+            "\"pit\": { \"id\": \"" + pit_id + "\", \"keep_alive\": \"1m\" },\n"
+            "\"sort\": [ \"_shard_doc\" ],\n"
+            + (search_after.empty() ? "\"track_total_hits\": true" : "\"search_after\": " + search_after)
+            + "\n}";
+
+        rapidjson::Document page;
+
+        if (!fetch_page(
+            crl,
+            options,
+            options.host + "/_search",
+            query,
+            true,
+            &page,
+            state))
+        {
+            ok = false;
+            break;
+        }
+
+        if (search_after.empty())
+        {
+            expected = total_hits(page);
+        }
+
+        // The id of a point in time may change from one search to the next.
+        if (page.HasMember("pit_id"))
+        {
+            pit_id = page["pit_id"].GetString();
+        }
+
+        auto const& hits = page["hits"]["hits"];
+
+        if (hits.Size() > 0)
+        {
+            search_after = to_json(hits[hits.Size() - 1]["sort"]);
+        }
+
+        write_document(
+            page,
+            options,
+            state,
+            &hits_count);
+    } while (hits_count > 0);
+
+    close_point_in_time(crl, options, pit_id);
+
+    if (ok && options.sample_budget == nullptr && expected >= 0 && state->documents != expected)
+    {
+        state->error << "Search ended after " << state->documents << " of " << expected << " documents";
+    }
+}
+
+void dump(
+    dump_options const& options,
+    thread_state      * state)
+{
+    CURL* crl = curl_easy_init();
+
+    if (options.share != nullptr)
+    {
+        curl_easy_setopt(crl, CURLOPT_SHARE, options.share);
+    }
+
+    if (options.retry.timeout > 0)
+    {
+        curl_easy_setopt(crl, CURLOPT_TIMEOUT, options.retry.timeout);
+    }
+
+    if (options.point_in_time)
+    {
+        dump_point_in_time(crl, options, state);
+    }
+    else
+    {
+        dump_scroll(crl, options, state);
+    }
+
+    curl_easy_cleanup(crl);
+}
+
+// Whether the cluster can page with a point in time and search_after, with
+// _shard_doc to break ties. Elasticsearch can from 7.12 on. Anything that
+// does not answer like Elasticsearch, such as OpenSearch, is scrolled.
+bool supports_point_in_time(
+    std::string  const& host,
+    auth_options const& auth)
+{
+    CURL                * crl = curl_easy_init();
+    long                  response_code;
+    rapidjson::Document   doc;
+    std::string           error;
+    std::vector<char>     buffer;
+
+    bool res = get_or_post_data(
+        crl,
+        host + "/",
+        auth,
+        &buffer,
+        &response_code,
+        &error);
+
+    curl_easy_cleanup(crl);
+
+    if (!res || response_code != 200)
+    {
+        return false;
+    }
+
+    doc.Parse(buffer.data(), buffer.size());
+
+    if (doc.HasParseError()
+        || !doc.IsObject()
+        || !doc.HasMember("version")
+        || !doc["version"].IsObject()
+        || !doc["version"].HasMember("number")
+        || !doc["version"]["number"].IsString()
+        || doc["version"].HasMember("distribution"))
+    {
+        return false;
+    }
+
+    int major = 0;
+    int minor = 0;
+
+    sscanf(doc["version"]["number"].GetString(), "%d.%d", &major, &minor);
+
+    return major > 7 || (major == 7 && minor >= 12);
+}
+
+int64_t count_documents(
+    std::string  const& host,
+    std::string  const& index,
+    auth_options const& auth,
+    std::ostream      & errors)
+{
+    CURL                * crl = curl_easy_init();
+    long                  response_code;
+    rapidjson::Document   doc;
+    std::string           url = host + "/" + index + "/_count";
+    std::string           error;
+    std::vector<char>     buffer;
+
+    bool res = get_or_post_data(
+        crl,
+        url,
+        auth,
+        &buffer,
+        &response_code,
+        &error);
+
+    if (!res)
+    {
+        errors << "A HTTP error occured: " << error << std::endl;
+        return -1;
+    }
+
+    doc.Parse(buffer.data(), buffer.size());
+
+    if (doc.HasParseError())
+    {
+        output_parser_error(doc, errors);
+        return -1;
+    }
+
+    return doc["count"].GetInt64();
+}
+
+// Resolves a comma separated list of index names, wildcards and aliases to
+// the concrete indices behind it, along with their document counts.
+bool resolve_indices(
+    std::string             const& host,
+    std::string             const& expression,
+    auth_options            const& auth,
+    std::vector<index_info>      * indices,
+    std::ostream                 & errors)
+{
+    CURL                * crl = curl_easy_init();
+    long                  response_code;
+    rapidjson::Document   doc;
+    std::string           url = host + "/_cat/indices/" + expression + "?format=json&h=index,pri,docs.count";
+    std::string           error;
+    std::vector<char>     buffer;
+
+    bool res = get_or_post_data(
+        crl,
+        url,
+        auth,
+        &buffer,
+        &response_code,
+        &error);
+
+    curl_easy_cleanup(crl);
+
+    if (!res)
+    {
+        errors << "A HTTP error occured: " << error << std::endl;
+        return false;
+    }
+
+    if (response_code != 200)
+    {
+        errors << "Server returned HTTP status " << response_code << " when resolving indices" << std::endl;
+        return false;
+    }
+
+    doc.Parse(buffer.data(), buffer.size());
+
+    if (doc.HasParseError())
+    {
+        output_parser_error(doc, errors);
+        return false;
+    }
+
+    for (rapidjson::Value const& row : doc.GetArray())
+    {
+        auto const& docs_count = row["docs.count"];
+
+        // Closed indices have no document count and cannot be searched.
+        if (!docs_count.IsString())
+        {
+            continue;
+        }
+
+        index_info info;
+        info.name   = row["index"].GetString();
+        info.docs   = std::stoll(docs_count.GetString());
+        info.shards = std::stoi(row["pri"].GetString());
+
+        indices->push_back(info);
+    }
+
+    std::sort(
+        indices->begin(),
+        indices->end(),
+        [](index_info const& lhs, index_info const& rhs)
+        {
+            return lhs.name < rhs.name;
+        });
+
+    return true;
+}
+
+// Finds the value at a dotted path, or nullptr when part of it is missing.
+rapidjson::Value const* find_path(
+    rapidjson::Value         const& root,
+    std::vector<std::string> const& path,
+    size_t                          depth)
+{
+    rapidjson::Value const* value = &root;
+
+    for (size_t i = 0; i < depth; i++)
+    {
+        if (!value->IsObject())
+        {
+            return nullptr;
+        }
+
+        auto member = value->FindMember(path[i].c_str());
+
+        if (member == value->MemberEnd())
+        {
+            return nullptr;
+        }
+
+        value = &member->value;
+    }
+
+    return value;
+}
+
+rapidjson::Value* find_path(
+    rapidjson::Value              & root,
+    std::vector<std::string> const& path,
+    size_t                          depth)
+{
+    return const_cast<rapidjson::Value*>(find_path(static_cast<rapidjson::Value const&>(root), path, depth));
+}
+
+// Puts a value at a dotted path, creating the objects on the way.
+void set_path(
+    rapidjson::Value                   & root,
+    std::vector<std::string>      const& path,
+    rapidjson::Value                   & value,
+    rapidjson::Document::AllocatorType & allocator)
+{
+    rapidjson::Value* parent = &root;
+
+    for (size_t i = 0; i + 1 < path.size(); i++)
+    {
+        auto member = parent->FindMember(path[i].c_str());
+
+        if (member == parent->MemberEnd())
+        {
+            rapidjson::Value name(path[i].c_str(), allocator);
+            rapidjson::Value object(rapidjson::kObjectType);
+            parent->AddMember(name, object, allocator);
+            parent = &(*parent)[path[i].c_str()];
+        }
+        else
+        {
+            parent = &member->value;
+
+            if (!parent->IsObject())
+            {
+                parent->SetObject();
+            }
+        }
+    }
+
+    auto member = parent->FindMember(path.back().c_str());
+
+    if (member != parent->MemberEnd())
+    {
+        member->value = value;
+    }
+    else
+    {
+        rapidjson::Value name(path.back().c_str(), allocator);
+        parent->AddMember(name, value, allocator);
+    }
+}
+
+std::vector<std::string> split_path(std::string const& text)
+{
+    std::vector<std::string> path;
+    std::string              part;
+    std::stringstream        parts(text);
+
+    while (std::getline(parts, part, '.'))
+    {
+        path.push_back(part);
+    }
+
+    return path;
+}
+
+bool document_transform::parse_template(
+    std::string const& text,
+    format           * out)
+{
+    size_t pos = 0;
+
+    while (pos < text.size())
+    {
+        size_t open = text.find('{', pos);
+
+        if (open != pos)
+        {
+            out->push_back({ text.substr(pos, open - pos), {} });
+
+            if (open == std::string::npos)
+            {
+                break;
+            }
+        }
+
+        size_t close = text.find('}', open);
+
+        if (close == std::string::npos || close == open + 1)
+        {
+            return false;
+        }
+
+        out->push_back({ "", split_path(text.substr(open + 1, close - open - 1)) });
+        pos = close + 1;
+    }
+
+    return true;
+}
+
+bool document_transform::render(
+    format      const& tmpl,
+    rapidjson::Value & hit,
+    std::string      * out)
+{
+    auto& source = hit["_source"];
+
+    out->clear();
+
+    for (auto const& part : tmpl)
+    {
+        if (part.field.empty())
+        {
+            out->append(part.text);
+            continue;
+        }
+
+        rapidjson::Value* value = nullptr;
+
+        if (part.field.size() == 1 && (part.field[0] == "_id" || part.field[0] == "_index"))
+        {
+            value = &hit[part.field[0].c_str()];
+        }
+        else
+        {
+            value = find_path(source, part.field, part.field.size());
+        }
+
+        if (value == nullptr || value->IsNull() || value->IsObject() || value->IsArray())
+        {
+            return false;
+        }
+
+        if (value->IsString())
+        {
+            out->append(value->GetString(), value->GetStringLength());
+        }
+        else
+        {
+            out->append(to_json(*value));
+        }
+    }
+
+    return true;
+}
+
+bool document_transform::load(std::string const& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::string   contents(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+
+    spec_.Parse(contents.data(), contents.size());
+
+    if (!file || spec_.HasParseError() || !spec_.IsObject())
+    {
+        std::cerr << "Could not read transform " << path << std::endl;
+        return false;
+    }
+
+    for (auto const& member : spec_.GetObject())
+    {
+        std::string key   = member.name.GetString();
+        auto const& value = member.value;
+        bool        ok    = true;
+
+        if (key == "drop" && value.IsArray())
+        {
+            for (auto const& field : value.GetArray())
+            {
+                ok = ok && field.IsString() && field.GetStringLength() > 0;
+
+                if (ok)
+                {
+                    drop_.push_back(split_path(field.GetString()));
+                }
+            }
+        }
+        else if (key == "rename" && value.IsObject())
+        {
+            for (auto const& field : value.GetObject())
+            {
+                ok = ok
+                    && field.name.GetStringLength() > 0
+                    && field.value.IsString()
+                    && field.value.GetStringLength() > 0;
+
+                if (ok)
+                {
+                    rename_.push_back({ split_path(field.name.GetString()), split_path(field.value.GetString()) });
+                }
+            }
+        }
+        else if (key == "set" && value.IsObject())
+        {
+            for (auto const& field : value.GetObject())
+            {
+                ok = ok && field.name.GetStringLength() > 0;
+
+                if (ok)
+                {
+                    set_.push_back({ split_path(field.name.GetString()), &field.value });
+                }
+            }
+        }
+        else if ((key == "id" || key == "index" || key == "routing") && value.IsString())
+        {
+            format& tmpl = key == "id" ? id_ : key == "index" ? index_ : routing_;
+            ok = parse_template(value.GetString(), &tmpl);
+        }
+        else
+        {
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            std::cerr << "Invalid \"" << key << "\" in transform " << path << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void document_transform::apply(
+    rapidjson::Value                   & hit,
+    rapidjson::Document::AllocatorType & allocator) const
+{
+    // Render the templates first, so they can use fields that are about
+    // to be dropped.
+    std::string id;
+    std::string index;
+    std::string routing;
+
+    bool has_id      = !id_.empty() && render(id_, hit, &id);
+    bool has_index   = !index_.empty() && render(index_, hit, &index);
+    bool has_routing = !routing_.empty() && render(routing_, hit, &routing);
+
+    auto& source = hit["_source"];
+
+    for (auto const& field : drop_)
+    {
+        auto* parent = find_path(source, field, field.size() - 1);
+
+        if (parent != nullptr && parent->IsObject())
+        {
+            parent->EraseMember(field.back().c_str());
+        }
+    }
+
+    for (auto const& field : rename_)
+    {
+        auto* parent = find_path(source, field.first, field.first.size() - 1);
+
+        if (parent == nullptr || !parent->IsObject() || !parent->HasMember(field.first.back().c_str()))
+        {
+            continue;
+        }
+
+        rapidjson::Value value;
+        value = (*parent)[field.first.back().c_str()];
+        parent->EraseMember(field.first.back().c_str());
+
+        set_path(source, field.second, value, allocator);
+    }
+
+    for (auto const& field : set_)
+    {
+        rapidjson::Value value(*field.second, allocator);
+        set_path(source, field.first, value, allocator);
+    }
+
+    if (has_id)
+    {
+        hit["_id"].SetString(id.data(), static_cast<rapidjson::SizeType>(id.size()), allocator);
+    }
+
+    if (has_index)
+    {
+        hit["_index"].SetString(index.data(), static_cast<rapidjson::SizeType>(index.size()), allocator);
+    }
+
+    if (has_routing)
+    {
+        rapidjson::Value value(routing.data(), static_cast<rapidjson::SizeType>(routing.size()), allocator);
+
+        if (hit.HasMember("_routing"))
+        {
+            hit["_routing"] = value;
+        }
+        else
+        {
+            hit.AddMember("_routing", value, allocator);
+        }
+    }
+}
+
+// Gets the current maximum of a field in an index, as seen by the shard
+// copies `preference` picks. The units of the index run with the same
+// preference, so they see at least what the mark covers. The mark is left
+// empty when the index has no documents.
+bool get_high_water_mark(
+    std::string  const& host,
+    std::string  const& index,
+    std::string  const& field,
+    std::string  const& preference,
+    auth_options const& auth,
+    std::string       * mark,
+    std::ostream      & errors)
+{
+    CURL                * crl = curl_easy_init();
+    long                  response_code;
+    rapidjson::Document   doc;
+    std::string           url = host + "/" + index + "/_search?preference=" + preference;
+    std::string           error;
+    std::vector<char>     buffer;
+
+    std::string query = "{\n"
+        "\"size\": 0,\n"
+        "\"aggs\": {\n"
+            "\"hwm\": { \"max\": { \"field\": \"" + field + "\" } }\n"
+        "}\n"
+    "}";
+
+    bool res = get_or_post_data(
+        crl,
+        url,
+        auth,
+        &buffer,
+        &response_code,
+        &error,
+        query);
+
+    curl_easy_cleanup(crl);
+
+    if (!res)
+    {
+        errors << "A HTTP error occured: " << error << std::endl;
+        return false;
+    }
+
+    if (response_code != 200)
+    {
+        errors << "Server returned HTTP status " << response_code << " when reading the high-water mark of " << index << std::endl;
+        return false;
+    }
+
+    doc.Parse(buffer.data(), buffer.size());
+
+    if (doc.HasParseError())
+    {
+        output_parser_error(doc, errors);
+        return false;
+    }
+
+    auto const& hwm = doc["aggregations"]["hwm"];
+
+    mark->clear();
+
+    if (hwm.HasMember("value_as_string"))
+    {
+        *mark = to_json(hwm["value_as_string"]);
+    }
+    else if (hwm["value"].IsNumber())
+    {
+        // Max aggregations report numbers as doubles.
+        *mark = std::to_string(static_cast<int64_t>(hwm["value"].GetDouble()));
+    }
+
+    // The aggregation is empty for a field that is not mapped or that no
+    // document has. Carrying on would dump nothing and still save the
+    // state, so only an empty index or shard may go without a mark.
+    if (mark->empty() && total_hits(doc) != 0)
+    {
+        errors << "No values for " << field << " in " << index << ", is it mapped?" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Gets the global checkpoint of every shard of an index, the highest
+// sequence number below which every operation has been processed on all
+// in-sync copies. Unlike the highest sequence number visible to searches,
+// nothing can still turn up below it. Marks are left empty for shards
+// without operations.
+bool get_global_checkpoints(
+    std::string              const& host,
+    std::string              const& index,
+    int                             shards,
+    auth_options             const& auth,
+    std::vector<std::string>      * marks,
+    std::ostream                  & errors)
+{
+    CURL                * crl = curl_easy_init();
+    long                  response_code;
+    rapidjson::Document   doc;
+    std::string           url = host + "/" + index + "/_stats/docs?level=shards";
+    std::string           error;
+    std::vector<char>     buffer;
+
+    bool res = get_or_post_data(
+        crl,
+        url,
+        auth,
+        &buffer,
+        &response_code,
+        &error);
+
+    curl_easy_cleanup(crl);
+
+    if (!res)
+    {
+        errors << "A HTTP error occured: " << error << std::endl;
+        return false;
+    }
+
+    if (response_code != 200)
+    {
+        errors << "Server returned HTTP status " << response_code << " when reading the checkpoints of " << index << std::endl;
+        return false;
+    }
+
+    doc.Parse(buffer.data(), buffer.size());
+
+    if (doc.HasParseError())
+    {
+        output_parser_error(doc, errors);
+        return false;
+    }
+
+    auto const* stats = doc.IsObject()
+        && doc.HasMember("indices")
+        && doc["indices"].IsObject()
+        && doc["indices"].HasMember(index.c_str())
+        ? &doc["indices"][index.c_str()]
+        : nullptr;
+
+    marks->assign(shards, "");
+
+    for (int i = 0; i < shards; i++)
+    {
+        std::string shard      = std::to_string(i);
+        int64_t     checkpoint = INT64_MAX;
+
+        if (stats == nullptr
+            || !stats->HasMember("shards")
+            || !(*stats)["shards"].HasMember(shard.c_str())
+            || !(*stats)["shards"][shard.c_str()].IsArray()
+            || (*stats)["shards"][shard.c_str()].Empty())
+        {
+            errors << "No stats for shard " << i << " of " << index << std::endl;
+            return false;
+        }
+
+        // Copies may lag behind the primary, take the lowest.
+        for (auto const& copy : (*stats)["shards"][shard.c_str()].GetArray())
+        {
+            if (!copy.HasMember("seq_no")
+                || !copy["seq_no"].IsObject()
+                || !copy["seq_no"].HasMember("global_checkpoint")
+                || !copy["seq_no"]["global_checkpoint"].IsInt64())
+            {
+                errors << "No global checkpoint for shard " << i << " of " << index << std::endl;
+                return false;
+            }
+
+            checkpoint = std::min(checkpoint, copy["seq_no"]["global_checkpoint"].GetInt64());
+        }
+
+        if (checkpoint >= 0)
+        {
+            (*marks)[i] = std::to_string(checkpoint);
+        }
+    }
+
+    return true;
+}
+
+// Makes everything indexed so far visible to searches on every copy.
+bool refresh_index(
+    std::string  const& host,
+    std::string  const& index,
+    auth_options const& auth,
+    std::ostream      & errors)
+{
+    CURL              * crl = curl_easy_init();
+    long                response_code;
+    std::string         error;
+    std::vector<char>   buffer;
+
+    bool res = get_or_post_data(
+        crl,
+        host + "/" + index + "/_refresh",
+        auth,
+        &buffer,
+        &response_code,
+        &error,
+        "",
+        "POST");
+
+    curl_easy_cleanup(crl);
+
+    if (!res)
+    {
+        errors << "A HTTP error occured: " << error << std::endl;
+        return false;
+    }
+
+    if (response_code != 200)
+    {
+        errors << "Server returned HTTP status " << response_code << " when refreshing " << index << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Checks that a state file has the shape save_since_state writes. Marks go
+// into queries as they are, so only numbers and strings pass.
+bool valid_since_state(rapidjson::Value const& doc)
+{
+    if (!doc.IsObject()
+        || !doc.HasMember("field")
+        || !doc["field"].IsString()
+        || !doc.HasMember("indices")
+        || !doc["indices"].IsObject())
+    {
+        return false;
+    }
+
+    for (auto const& index : doc["indices"].GetObject())
+    {
+        if (!index.value.IsObject())
+        {
+            return false;
+        }
+
+        for (auto const& mark : index.value.GetObject())
+        {
+            if (!mark.value.IsNumber() && !mark.value.IsString())
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool load_since_state(
+    std::string  const& path,
+    std::string  const& field,
+    since_state       * state,
+    std::ostream      & errors)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    // No state yet means the first run is a full dump.
+    if (!file)
+    {
+        return true;
+    }
+
+    std::string contents(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+
+    rapidjson::Document doc;
+    doc.Parse(contents.data(), contents.size());
+
+    if (doc.HasParseError())
+    {
+        errors << "Could not read state file " << path << ": ";
+        output_parser_error(doc, errors);
+        errors << std::endl;
+        return false;
+    }
+
+    if (!valid_since_state(doc))
+    {
+        errors << "Not a state file: " << path << std::endl;
+        return false;
+    }
+
+    if (field != doc["field"].GetString())
+    {
+        errors << "State file " << path << " tracks " << doc["field"].GetString()
+               << ", not " << field << " - doing a full dump" << std::endl;
+        return true;
+    }
+
+    for (auto const& index : doc["indices"].GetObject())
+    {
+        auto& marks = (*state)[index.name.GetString()];
+
+        for (auto const& mark : index.value.GetObject())
+        {
+            marks[mark.name.GetString()] = to_json(mark.value);
+        }
+    }
+
+    return true;
+}
+
+bool save_since_state(
+    std::string  const& path,
+    std::string  const& field,
+    since_state  const& state,
+    std::ostream      & errors)
+{
+    rapidjson::StringBuffer                    buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+
+    writer.StartObject();
+    writer.Key("field");
+    writer.String(field.c_str());
+    writer.Key("indices");
+    writer.StartObject();
+
+    for (auto const& index : state)
+    {
+        writer.Key(index.first.c_str());
+        writer.StartObject();
+
+        for (auto const& mark : index.second)
+        {
+            writer.Key(mark.first.c_str());
+            writer.RawValue(mark.second.c_str(), mark.second.size(), rapidjson::kStringType);
+        }
+
+        writer.EndObject();
+    }
+
+    writer.EndObject();
+    writer.EndObject();
+
+    // Write next to the old state and swap it in, so a crash never leaves
+    // a truncated state file behind.
+    std::string tmp_path = path + ".tmp";
+    FILE*       file     = fopen(tmp_path.c_str(), "wb");
+
+    if (file == nullptr)
+    {
+        errors << "Could not write state file " << tmp_path << std::endl;
+        return false;
+    }
+
+    fwrite(buffer.GetString(), 1, buffer.GetSize(), file);
+    fputc('\n', file);
+
+    if (fclose(file) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        errors << "Could not write state file " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Wraps a query so that a random, but repeatable, `fraction` of the
+// documents matching it is kept. Scores are uniform in [0, 1) and derived
+// from the seed and _seq_no of each document.
+std::string sample_filter(
+    std::string const& query,
+    double             fraction,
+    int64_t            seed)
+{
+    std::stringstream filter;
+
+    filter << "{ \"function_score\": { "
+           << "\"query\": " << (query.empty() ? "{ \"match_all\": {} }" : query) << ", "
+           << "\"random_score\": { \"seed\": " << seed << ", \"field\": \"_seq_no\" }, "
+           << "\"boost_mode\": \"replace\", "
+           << "\"min_score\": " << std::setprecision(17) << 1 - fraction
+           << " } }";
+
+    return filter.str();
+}
+
+// Selects the documents above the previous mark and up to the current
+// one. Without a previous mark, documents lacking a timestamp field are
+// taken as well, or the first run would never dump them.
+std::string range_filter(
+    std::string const& field,
+    std::string const& from,
+    std::string const& to)
+{
+    std::string bounds = "\"lte\": " + to;
+
+    if (!from.empty())
+    {
+        bounds += ", \"gt\": " + from;
+    }
+
+    std::string range = "{ \"range\": { \"" + field + "\": { " + bounds + " } } }";
+
+    if (!from.empty() || field == SEQ_NO_FIELD)
+    {
+        return range;
+    }
+
+    return "{ \"bool\": { \"should\": [ " + range + ", "
+        "{ \"bool\": { \"must_not\": { \"exists\": { \"field\": \"" + field + "\" } } } } ] } }";
+}
+
+bool write_sidecar(
+    std::string          const& path,
+    std::vector<sidecar_entry>* entries,
+    std::ostream              & errors)
+{
+    std::sort(entries->begin(), entries->end());
+
+    sidecar_header header = {};
+    std::copy(SIDECAR_MAGIC, SIDECAR_MAGIC + sizeof(header.magic), header.magic);
+    header.count = entries->size();
+
+    FILE* file = fopen(path.c_str(), "wb");
+
+    if (file == nullptr)
+    {
+        errors << "Could not write sidecar index " << path << std::endl;
+        return false;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(entries->data(), sizeof(sidecar_entry), entries->size(), file);
+
+    if (fclose(file) != 0)
+    {
+        errors << "Could not write sidecar index " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Sorts the buffered records of a slice and writes them to a temporary
+// run file, as a sequence of (key length, key, record length, record).
+void output_sink::spill_run(
+    sort_run     * run,
+    thread_state * state)
+{
+    if (run->entries.empty())
+    {
+        return;
+    }
+
+    char const* arena = run->arena.data();
+
+    std::sort(
+        run->entries.begin(),
+        run->entries.end(),
+        [arena](sort_run::entry const& lhs, sort_run::entry const& rhs)
+        {
+            int cmp = memcmp(arena + lhs.key, arena + rhs.key, std::min(lhs.key_length, rhs.key_length));
+            return cmp < 0 || (cmp == 0 && lhs.key_length < rhs.key_length);
+        });
+
+    std::string path;
+    FILE*       file = create_run(options_.sort_dir, &path);
+
+    if (file == nullptr)
+    {
+        state->error << "Could not create sort run in " << options_.sort_dir;
+        return;
+    }
+
+    for (auto const& entry : run->entries)
+    {
+        write_block(arena + entry.key, entry.key_length, file);
+        write_block(arena + entry.key + entry.key_length, entry.length, file);
+    }
+
+    if (fclose(file) != 0)
+    {
+        state->error << "Could not write sort run " << path;
+    }
+
+    run->arena.clear();
+    run->entries.clear();
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    runs_.push_back(path);
+}
+
+// Merges runs in key order, passing every record to `emit`. Returns false
+// when one of them could not be read.
+bool merge_group(
+    std::vector<std::string>                                               const& paths,
+    std::function<void(std::string const& key, std::string const& record)> const& emit,
+    std::ostream                                                                & errors)
+{
+    std::vector<std::unique_ptr<run_reader>> readers;
+
+    for (auto const& path : paths)
+    {
+        readers.push_back(std::unique_ptr<run_reader>(new run_reader(path)));
+    }
+
+    auto greater = [&readers](size_t lhs, size_t rhs)
+    {
+        return readers[lhs]->key > readers[rhs]->key;
+    };
+
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        if (readers[i]->next())
+        {
+            heap.push(i);
+        }
+    }
+
+    while (!heap.empty())
+    {
+        size_t i   = heap.top();
+        auto&  run = *readers[i];
+
+        heap.pop();
+        emit(run.key, run.record);
+
+        if (run.next())
+        {
+            heap.push(i);
+        }
+    }
+
+    bool ok = true;
+
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        if (!readers[i]->good())
+        {
+            errors << "Could not read sort run " << paths[i] << std::endl;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+// Streams all spilled runs to the output in key order with a k-way merge,
+// and removes them. Runs are first merged MERGE_FAN_IN at a time into
+// longer ones until no more than that are left, so the number of files
+// open at once stays bounded however many runs were spilled.
+bool output_sink::merge_runs(std::ostream& errors)
+{
+    bool ok = true;
+
+    while (ok && runs_.size() > MERGE_FAN_IN)
+    {
+        std::vector<std::string> merged;
+        size_t                   i = 0;
+
+        for (; ok && i < runs_.size(); i += MERGE_FAN_IN)
+        {
+            std::vector<std::string> group(
+                runs_.begin() + i,
+                runs_.begin() + std::min(i + MERGE_FAN_IN, runs_.size()));
+
+            if (group.size() == 1)
+            {
+                merged.push_back(group[0]);
+                continue;
+            }
+
+            std::string path;
+            FILE*       file = create_run(options_.sort_dir, &path);
+
+            if (file == nullptr)
+            {
+                errors << "Could not create sort run in " << options_.sort_dir << std::endl;
+                ok = false;
+                break;
+            }
+
+            merged.push_back(path);
+
+            ok = merge_group(group, [file](std::string const& key, std::string const& record)
+            {
+                write_block(key.data(), static_cast<uint32_t>(key.size()), file);
+                write_block(record.data(), static_cast<uint32_t>(record.size()), file);
+            }, errors);
+
+            if (fclose(file) != 0)
+            {
+                errors << "Could not write sort run " << path << std::endl;
+                ok = false;
+            }
+
+            for (auto const& done : group)
+            {
+                remove(done.c_str());
+            }
+        }
+
+        // Whatever was not merged yet is left for the cleanup below.
+        merged.insert(merged.end(), runs_.begin() + std::min(i, runs_.size()), runs_.end());
+        runs_.swap(merged);
+    }
+
+    std::vector<sidecar_entry> entries;
+
+    if (ok)
+    {
+        ok = merge_group(runs_, [this, &entries](std::string const& key, std::string const& record)
+        {
+            entries.clear();
+
+            if (!options_.sidecar.empty())
+            {
+                // The key is the index and the _id, separated by a NUL.
+                size_t id = key.find('\0') + 1;
+                entries.push_back({ hash_id(key.data() + id, key.size() - id), 0 });
+            }
+
+            write(record.data(), record.size(), entries);
+        }, errors);
+    }
+
+    for (auto const& path : runs_)
+    {
+        remove(path.c_str());
+    }
+
+    runs_.clear();
+
+    return ok;
+}
+
+output_sink::output_sink(
+    FILE                 * file,
+    output_options const & options)
+    : file_(file),
+      options_(options),
+      offset_(0),
+      run_bytes_(0)
+{
+}
+
+bool output_sink::begin(
+    int            threads,
+    std::ostream & errors)
+{
+    if (options_.sorted)
+    {
+        run_bytes_ = std::max<size_t>(1, options_.sort_memory * 1024 * 1024 / threads);
+    }
+
+    if (options_.format != FORMAT_NDJSON)
+    {
+        binary_header header;
+        std::copy(BINARY_MAGIC, BINARY_MAGIC + sizeof(header.magic), header.magic);
+        header.format = static_cast<uint8_t>(options_.format);
+
+        std::vector<sidecar_entry> none;
+        write(reinterpret_cast<char const*>(&header), sizeof(header), none);
+    }
+
+    return true;
+}
+
+void output_sink::write(
+    char                 const* data,
+    size_t                      size,
+    std::vector<sidecar_entry>& entries)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    fwrite(data, 1, size, file_);
+
+    for (auto& entry : entries)
+    {
+        entry.offset += offset_;
+        entries_.push_back(entry);
+    }
+
+    offset_ += size;
+}
+
+// Lets a JSON writer append to a std::string.
+struct string_stream
+{
+    typedef char Ch;
+
+    std::string* out;
+
+    void Put(char c)
+    {
+        out->push_back(c);
+    }
+
+    void Flush()
+    {
+    }
+};
+
+// Serializes the first `count` hits of a page in `format`, noting where
+// each record starts. The last start is the end of the page.
+void serialize_page(
+    rapidjson::Value const* hits,
+    rapidjson::SizeType     count,
+    dump_options     const& options,
+    int                     format,
+    bool                    checksum,
+    thread_state          * state,
+    std::string           * page,
+    std::vector<size_t>   * starts)
+{
+    bool include_index   = options.include_index;
+    bool include_routing = options.include_routing;
+
+    if (format != FORMAT_NDJSON)
+    {
+        for (rapidjson::SizeType i = 0; i < count; i++)
+        {
+            auto const& hit   = hits[i];
+            size_t      start = page->size();
+
+            starts->push_back(start);
+
+            if (format == FORMAT_CBOR)
+            {
+                encode_record<cbor_codec>(hit, include_index, include_routing, page);
+            }
+            else
+            {
+                encode_record<msgpack_codec>(hit, include_index, include_routing, page);
+            }
+
+            if (checksum)
+            {
+                state->checksum += hash_id(page->data() + start + 4, page->size() - start - 4);
+            }
+        }
+    }
+    else
+    {
+        string_stream                   stream { page };
+        rapidjson::Writer<string_stream> writer(stream);
+
+        for (rapidjson::SizeType i = 0; i < count; i++)
+        {
+            auto const& hit = hits[i];
+            auto const& id  = hit["_id"];
+
+            // Serialize to output stream. Do it in two steps to get
+            // new-line separated JSON.
+
+            size_t action_start = page->size();
+
+            starts->push_back(action_start);
+
+            writer.StartObject();
+            writer.Key("index");
+            writer.StartObject();
+
+            if (include_index)
+            {
+                auto const& index = hit["_index"];
+                writer.Key("_index");
+                writer.String(index.GetString(), index.GetStringLength());
+            }
+
+            writer.Key("_id");
+            writer.String(id.GetString(), id.GetStringLength());
+
+            if (include_routing && hit.HasMember("_routing"))
+            {
+                auto const& routing = hit["_routing"];
+                writer.Key("routing");
+                writer.String(routing.GetString(), routing.GetStringLength());
+            }
+
+            writer.EndObject();
+            writer.EndObject();
+
+            size_t source_start = page->size() + 1;
+            stream.Put('\n');
+            writer.Reset(stream);
+
+            hit["_source"].Accept(writer);
+            size_t source_end = page->size();
+            stream.Put('\n');
+            writer.Reset(stream);
+
+            if (checksum)
+            {
+                char const* data = page->data();
+                state->checksum += hash_id(data + action_start, source_start - 1 - action_start);
+                state->checksum += hash_id(data + source_start, source_end - source_start);
+            }
+        }
+    }
+
+    starts->push_back(page->size());
+}
+
+void output_sink::write_page(
+    rapidjson::Value const* hits,
+    rapidjson::SizeType     count,
+    dump_options     const& options,
+    thread_state          * state)
+{
+    // Serialize the whole page before taking the output lock, so slices
+    // only contend for the write itself.
+    std::string                page;
+    std::vector<size_t>        starts;
+    std::vector<sidecar_entry> entries;
+
+    serialize_page(hits, count, options, options_.format, options_.checksum, state, &page, &starts);
+
+    for (rapidjson::SizeType i = 0; i < count; i++)
+    {
+        auto const& id = hits[i]["_id"];
+
+        if (options_.sorted)
+        {
+            add_sort_record(
+                &state->run,
+                hits[i]["_index"].GetString(),
+                std::string(id.GetString(), id.GetStringLength()),
+                page.data() + starts[i],
+                starts[i + 1] - starts[i]);
+        }
+        else if (!options_.sidecar.empty())
+        {
+            entries.push_back({ hash_id(id.GetString(), id.GetStringLength()), starts[i] });
+        }
+    }
+
+    if (options_.sorted)
+    {
+        if (state->run.arena.size() >= run_bytes_)
+        {
+            spill_run(&state->run, state);
+        }
+
+        return;
+    }
+
+    write(page.data(), page.size(), entries);
+}
+
+void output_sink::finish_unit(thread_state* state)
+{
+    if (options_.sorted)
+    {
+        spill_run(&state->run, state);
+
+        // clear() keeps the capacity, and finished units would otherwise
+        // hold on to their buffers until the end of the dump.
+        std::string().swap(state->run.arena);
+        std::vector<sort_run::entry>().swap(state->run.entries);
+    }
+}
+
+bool output_sink::finish(std::ostream& errors)
+{
+    bool ok = true;
+
+    if (options_.sorted && !merge_runs(errors))
+    {
+        ok = false;
+    }
+
+    fflush(file_);
+
+    // The sidecar is written even when some slices failed, it indexes
+    // everything that did make it into the dump.
+    if (!options_.sidecar.empty() && !write_sidecar(options_.sidecar, &entries_, errors))
+    {
+        ok = false;
+    }
+
+    return ok;
+}
+
+// Formats a date given as epoch milliseconds, or as an ISO 8601 string.
+// Strings are taken as written, without time zone conversion.
+bool format_date(
+    rapidjson::Value const& value,
+    std::string      const& format,
+    std::string           * out)
+{
+    std::tm tm = {};
+
+    if (value.IsNumber())
+    {
+        time_t seconds = static_cast<time_t>(value.GetDouble() / 1000);
+
+        if (gmtime_r(&seconds, &tm) == nullptr)
+        {
+            return false;
+        }
+    }
+    else if (value.IsString())
+    {
+        int fields = sscanf(
+            value.GetString(),
+            "%d-%d-%d%*c%d:%d:%d",
+            &tm.tm_year,
+            &tm.tm_mon,
+            &tm.tm_mday,
+            &tm.tm_hour,
+            &tm.tm_min,
+            &tm.tm_sec);
+
+        if (fields < 3)
+        {
+            return false;
+        }
+
+        tm.tm_year -= 1900;
+        tm.tm_mon  -= 1;
+
+        // Fill in the weekday and the day of the year for %a, %A and %j.
+        time_t seconds = timegm(&tm);
+
+        if (gmtime_r(&seconds, &tm) == nullptr)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    char   buffer[256];
+    size_t length = strftime(buffer, sizeof(buffer), format.c_str(), &tm);
+
+    out->assign(buffer, length);
+
+    return length > 0;
+}
+
+partition_sink::partition_sink(
+    output_options    const& output,
+    partition_options const& options)
+    : output_(output),
+      options_(options),
+      field_(split_path(options.field)),
+      buffered_(0)
+{
+}
+
+partition_sink::~partition_sink()
+{
+    for (auto* part : open_)
+    {
+        fclose(part->file);
+    }
+}
+
+bool partition_sink::begin(
+    int            threads,
+    std::ostream & errors)
+{
+    if (mkdir(options_.dir.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+        errors << "Could not create " << options_.dir << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+std::string partition_sink::partition_name(rapidjson::Value const& hit) const
+{
+    auto const* value = find_path(hit["_source"], field_, field_.size());
+    std::string name;
+
+    if (value == nullptr)
+    {
+        return MISSING_PARTITION;
+    }
+
+    if (!options_.date_format.empty())
+    {
+        if (!format_date(*value, options_.date_format, &name))
+        {
+            return MISSING_PARTITION;
+        }
+    }
+    else if (value->IsString())
+    {
+        name.assign(value->GetString(), value->GetStringLength());
+    }
+    else if (value->IsNumber() || value->IsBool())
+    {
+        name = to_json(*value);
+    }
+    else
+    {
+        // Null, objects and arrays have no single value to go by.
+        return MISSING_PARTITION;
+    }
+
+    if (name.empty())
+    {
+        return EMPTY_PARTITION;
+    }
+
+    // Keep the name to one harmless path component, percent-encoding
+    // everything else so distinct values never share a file. A leading
+    // '.' would hide the file, and a leading '_' is kept for the names
+    // above.
+    static char const hex[] = "0123456789ABCDEF";
+    std::string       encoded;
+
+    for (size_t i = 0; i < name.size(); i++)
+    {
+        unsigned char c = static_cast<unsigned char>(name[i]);
+
+        if ((isalnum(c) || c == '-' || c == '_' || c == '.' || c == '@' || c == '+')
+            && !(i == 0 && (c == '.' || c == '_')))
+        {
+            encoded.push_back(static_cast<char>(c));
+        }
+        else
+        {
+            encoded.push_back('%');
+            encoded.push_back(hex[c >> 4]);
+            encoded.push_back(hex[c & 15]);
+        }
+    }
+
+    return encoded;
+}
+
+// Writes out the buffer of a partition, opening its file when it is not
+// open yet and closing the least recently written one to make room.
+bool partition_sink::flush(partition* part)
+{
+    bool ok = true;
+
+    if (part->file == nullptr)
+    {
+        if (!open_.empty() && open_.size() >= static_cast<size_t>(std::max(options_.max_open_files, 1)))
+        {
+            partition* last = open_.back();
+
+            open_.pop_back();
+            ok = fclose(last->file) == 0;
+            last->file = nullptr;
+        }
+
+        part->file = fopen(part->path.c_str(), part->created ? "ab" : "wb");
+
+        if (part->file == nullptr)
+        {
+            buffered_ -= part->buffer.size();
+            std::string().swap(part->buffer);
+            return false;
+        }
+
+        if (!part->created && output_.format != FORMAT_NDJSON)
+        {
+            binary_header header;
+            std::copy(BINARY_MAGIC, BINARY_MAGIC + sizeof(header.magic), header.magic);
+            header.format = static_cast<uint8_t>(output_.format);
+
+            fwrite(&header, sizeof(header), 1, part->file);
+        }
+
+        part->created = true;
+    }
+    else
+    {
+        open_.remove(part);
+    }
+
+    open_.push_front(part);
+
+    ok = fwrite(part->buffer.data(), 1, part->buffer.size(), part->file) == part->buffer.size() && ok;
+
+    // Give the memory back, most partitions are not written to again
+    // for a while.
+    buffered_ -= part->buffer.size();
+    std::string().swap(part->buffer);
+
+    return ok;
+}
+
+void partition_sink::write_page(
+    rapidjson::Value const* hits,
+    rapidjson::SizeType     count,
+    dump_options     const& options,
+    thread_state          * state)
+{
+    std::string         page;
+    std::vector<size_t> starts;
+
+    serialize_page(hits, count, options, output_.format, output_.checksum, state, &page, &starts);
+
+    // Group the page by partition before taking the lock.
+    std::map<std::string, std::string> groups;
+
+    for (rapidjson::SizeType i = 0; i < count; i++)
+    {
+        groups[partition_name(hits[i])].append(page.data() + starts[i], starts[i + 1] - starts[i]);
+    }
+
+    char const* extension = output_.format == FORMAT_CBOR    ? ".cbor"
+                          : output_.format == FORMAT_MSGPACK ? ".msgpack"
+                          : ".ndjson";
+
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    for (auto& group : groups)
+    {
+        auto& part = partitions_[group.first];
+
+        if (part.path.empty())
+        {
+            part.path = options_.dir + "/" + group.first + extension;
+        }
+
+        part.buffer.append(group.second);
+        buffered_ += group.second.size();
+
+        if (part.buffer.size() >= PARTITION_BUF_SIZE && !flush(&part))
+        {
+            state->error << "Could not write partition " << part.path << ": " << strerror(errno) << "\n";
+        }
+    }
+
+    // Past the memory limit, write out the largest buffers until they are
+    // down to half of it.
+    size_t max_buffered = options_.max_memory * 1024 * 1024;
+
+    if (buffered_ > max_buffered)
+    {
+        std::vector<partition*> parts;
+
+        for (auto& entry : partitions_)
+        {
+            if (!entry.second.buffer.empty())
+            {
+                parts.push_back(&entry.second);
+            }
+        }
+
+        std::sort(parts.begin(), parts.end(), [](partition const* lhs, partition const* rhs)
+        {
+            return lhs->buffer.size() > rhs->buffer.size();
+        });
+
+        for (auto* part : parts)
+        {
+            if (buffered_ <= max_buffered / 2)
+            {
+                break;
+            }
+
+            if (!flush(part))
+            {
+                state->error << "Could not write partition " << part->path << ": " << strerror(errno) << "\n";
+            }
+        }
+    }
+}
+
+bool partition_sink::finish(std::ostream& errors)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    bool ok = true;
+
+    for (auto& entry : partitions_)
+    {
+        auto& part = entry.second;
+
+        if (!part.buffer.empty() && !flush(&part))
+        {
+            errors << "Could not write partition " << part.path << ": " << strerror(errno) << std::endl;
+            ok = false;
+        }
+    }
+
+    for (auto* part : open_)
+    {
+        if (fclose(part->file) != 0)
+        {
+            errors << "Could not write partition " << part->path << std::endl;
+            ok = false;
+        }
+
+        part->file = nullptr;
+    }
+
+    open_.clear();
+
+    return ok;
+}
+
+// Pulls documents out of a dump by _id, using the sidecar index written
+// alongside it. Each match is printed as its two bulk lines.
+int lookup_documents(
+    std::string              const& dump_path,
+    std::string              const& sidecar_path,
+    std::vector<std::string> const& ids)
+{
+    int fd = open(sidecar_path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        std::cerr << "Could not open sidecar index " << sidecar_path << std::endl;
+        return 1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+
+    if (static_cast<size_t>(st.st_size) < sizeof(sidecar_header))
+    {
+        std::cerr << "Sidecar index " << sidecar_path << " is truncated" << std::endl;
+        close(fd);
+        return 1;
+    }
+
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "Could not map sidecar index " << sidecar_path << std::endl;
+        return 1;
+    }
+
+    auto const* header = reinterpret_cast<sidecar_header const*>(mapped);
+
+    if (!std::equal(header->magic, header->magic + sizeof(header->magic), SIDECAR_MAGIC)
+        || sizeof(sidecar_header) + header->count * sizeof(sidecar_entry) > static_cast<size_t>(st.st_size))
+    {
+        std::cerr << "Not a sidecar index: " << sidecar_path << std::endl;
+        munmap(mapped, st.st_size);
+        return 1;
+    }
+
+    auto const* begin = reinterpret_cast<sidecar_entry const*>(header + 1);
+    auto const* end   = begin + header->count;
+
+    std::ifstream dump_file(dump_path, std::ios::binary);
+
+    if (!dump_file)
+    {
+        std::cerr << "Could not open dump " << dump_path << std::endl;
+        munmap(mapped, st.st_size);
+        return 1;
+    }
+
+    int                  format;
+    int                  exit_code = 0;
+    std::vector<uint8_t> record;
+
+    read_dump_header(dump_file, &format);
+
+    for (auto const& id : ids)
+    {
+        sidecar_entry key   = { hash_id(id.data(), id.size()), 0 };
+        auto          first = std::lower_bound(begin, end, key);
+        bool          found = false;
+
+        // Different ids can share a hash, so confirm each candidate
+        // against the action line it points at.
+        for (auto it = first; it != end && it->hash == key.hash; ++it)
+        {
+            std::string action;
+            std::string source;
+
+            dump_file.clear();
+            dump_file.seekg(it->offset);
+
+            if (format == FORMAT_NDJSON)
+            {
+                std::getline(dump_file, action);
+                std::getline(dump_file, source);
+            }
+            else if (!read_record(dump_file, &record)
+                || !decode_record(format, record.data(), record.size(), &action, &source))
+            {
+                action.clear();
+            }
+
+            rapidjson::Document doc;
+            doc.Parse(action.data(), action.size());
+
+            if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("index"))
+            {
+                std::cerr << "Sidecar index does not match dump at offset " << it->offset << std::endl;
+                exit_code = 1;
+                break;
+            }
+
+            auto const& doc_id = doc["index"]["_id"];
+
+            if (id.compare(0, id.size(), doc_id.GetString(), doc_id.GetStringLength()) == 0)
+            {
+                std::cout << action << '\n' << source << '\n';
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            std::cerr << "Document not found: " << id << std::endl;
+            exit_code = 1;
+        }
+    }
+
+    munmap(mapped, st.st_size);
+
+    return exit_code;
+}
+
+dump_options unit_options(
+    dump_options const& base,
+    work_unit         * unit)
+{
+    dump_options opts = base;
+    opts.index        = unit->index;
+    opts.slice_id     = unit->slice_id;
+    opts.slice_max    = unit->slice_max;
+    opts.filter       = unit->filter;
+
+    if (unit->sample >= 0)
+    {
+        opts.sample_budget = &unit->sample;
+    }
+
+    std::string preference = unit->preference;
+
+    // _shards must come first when combined with another preference.
+    if (unit->shard >= 0)
+    {
+        preference = "_shards:" + std::to_string(unit->shard) + (preference.empty() ? "" : "|") + preference;
+    }
+
+    if (!preference.empty())
+    {
+        opts.preference = "&preference=" + preference;
+    }
+
+    return opts;
+}
+
+void dump_unit(
+    dump_options const& base,
+    work_unit         * unit)
+{
+    dump(unit_options(base, unit), &unit->state);
+
+    // A unit that ran out of documents before its share was complete
+    // leaves the rest to the units still running.
+    if (base.sample_spare != nullptr && unit->sample > 0)
+    {
+        *base.sample_spare += unit->sample;
+        unit->sample        = 0;
+    }
+
+    base.sink->finish_unit(&unit->state);
+}
+
+// Asks the cluster how many documents a unit covers. Slicing is only
+// allowed on scroll requests, so this opens a scroll for a single hit and
+// reads the total from it.
+void count_unit(
+    dump_options const& base,
+    work_unit         * unit)
+{
+    dump_options options = unit_options(base, unit);
+    CURL*        crl     = curl_easy_init();
+
+    if (options.share != nullptr)
+    {
+        curl_easy_setopt(crl, CURLOPT_SHARE, options.share);
+    }
+
+    std::string query = "{\n"
+        "\"size\": 1,\n"
+        "\"track_total_hits\": true,\n"
+        "\"_source\": false";
+
+    if (!options.filter.empty())
+    {
+        query += ",\n"
+        "\"query\": " + options.filter;
+    }
+
+    if (options.slice_max > 1)
+    {
+        query += ",\n"
+        "\"slice\": {\n"
+            "\"id\": " + std::to_string(options.slice_id) + ",\n"
+            "\"max\": " + std::to_string(options.slice_max) + "\n"
+        "}";
+    }
+
+    query += "\n}";
+
+    std::vector<char> buffer;
+    long              response_code;
+    std::string       error;
+
+    bool res = get_or_post_data(
+        crl,
+        options.host + "/" + options.index + "/_search?scroll=1m" + options.preference,
+        options.auth,
+        &buffer,
+        &response_code,
+        &error,
+        query);
+
+    if (!res)
+    {
+        unit->state.error << "A HTTP error occured: " << error;
+    }
+    else if (response_code != 200)
+    {
+        unit->state.error << "Server returned HTTP status " << response_code << ": " << std::string(buffer.begin(), buffer.end());
+    }
+    else
+    {
+        rapidjson::Document doc;
+        doc.Parse(buffer.data(), buffer.size());
+
+        if (doc.HasParseError())
+        {
+            output_parser_error(doc, unit->state.error);
+        }
+        else
+        {
+            unit->state.live = total_hits(doc);
+
+            clear_scroll(crl, options, doc["_scroll_id"].GetString());
+        }
+    }
+
+    curl_easy_cleanup(crl);
+}
+
+void run_worker(
+    work_scheduler     * scheduler,
+    size_t               worker,
+    dump_options const & base,
+    unit_job             job)
+{
+    while (work_unit* unit = scheduler->next(worker))
+    {
+        job(base, unit);
+    }
+}
+
+// Runs a job for every unit on a pool of `thread_count` workers.
+void run_units(
+    std::vector<std::unique_ptr<work_unit>> & units,
+    int                                       thread_count,
+    dump_options                      const & base,
+    unit_job                                  job)
+{
+    // Deal the largest units out first so the long running work starts
+    // immediately and the small units are left to be stolen at the end.
+    std::stable_sort(
+        units.begin(),
+        units.end(),
+        [](std::unique_ptr<work_unit> const& lhs, std::unique_ptr<work_unit> const& rhs)
+        {
+            return lhs->docs > rhs->docs;
+        });
+
+    if (base.pool != nullptr)
+    {
+        std::vector<work_unit*> pending;
+
+        for (auto& unit : units)
+        {
+            pending.push_back(unit.get());
+        }
+
+        base.pool->run(pending, base, job);
+        return;
+    }
+
+    work_scheduler           scheduler(thread_count);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < units.size(); i++)
+    {
+        scheduler.push(i, units[i].get());
+    }
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        threads.push_back(std::thread(run_worker, &scheduler, i, base, job));
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+struct worker_pool::batch
+{
+    std::vector<work_unit*> const& units;
+    dump_options            const& base;
+    unit_job                       job;
+    size_t                         next;
+    size_t                         done;
+    std::condition_variable        finished;
+};
+
+worker_pool::worker_pool(int threads)
+    : stop_(false)
+{
+    for (int i = 0; i < threads; i++)
+    {
+        threads_.push_back(std::thread(&worker_pool::work, this));
+    }
+}
+
+worker_pool::~worker_pool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        stop_ = true;
+    }
+
+    cv_.notify_all();
+
+    for (auto& thread : threads_)
+    {
+        thread.join();
+    }
+}
+
+void worker_pool::run(
+    std::vector<work_unit*> const& units,
+    dump_options            const& base,
+    unit_job                       job)
+{
+    if (units.empty())
+    {
+        return;
+    }
+
+    batch current { units, base, job, 0, 0 };
+
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    batches_.push_back(&current);
+    cv_.notify_all();
+
+    current.finished.wait(lock, [&current] { return current.done == current.units.size(); });
+}
+
+void worker_pool::work()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    while (true)
+    {
+        cv_.wait(lock, [this] { return stop_ || !batches_.empty(); });
+
+        if (batches_.empty())
+        {
+            return;
+        }
+
+        // Take one unit and send the batch to the back of the line, so a
+        // large dump can't keep the workers from a small one.
+        batch*     current = batches_.front();
+        work_unit* unit    = current->units[current->next++];
+
+        batches_.pop_front();
+
+        if (current->next < current->units.size())
+        {
+            batches_.push_back(current);
+        }
+
+        lock.unlock();
+        current->job(current->base, unit);
+        lock.lock();
+
+        if (++current->done == current->units.size())
+        {
+            current->finished.notify_all();
+        }
+    }
+}
+
+connection_pool::connection_pool()
+    : share_(curl_share_init())
+{
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &connection_pool::lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &connection_pool::unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+connection_pool::~connection_pool()
+{
+    curl_share_cleanup(share_);
+}
+
+void connection_pool::lock(
+    CURL             * handle,
+    curl_lock_data     data,
+    curl_lock_access   access,
+    void             * pool)
+{
+    static_cast<connection_pool*>(pool)->mtx_[data].lock();
+}
+
+void connection_pool::unlock(
+    CURL           * handle,
+    curl_lock_data   data,
+    void           * pool)
+{
+    static_cast<connection_pool*>(pool)->mtx_[data].unlock();
+}
+
+// Prints the errors of failed units, returning the exit code.
+int report_errors(
+    std::vector<std::unique_ptr<work_unit>> const& units,
+    std::ostream                                 & errors)
+{
+    int exit_code = 0;
+
+    for (auto& unit : units)
+    {
+        if (unit->state.error.tellp() > 0)
+        {
+            errors << "Slice "
+                   << std::setw(2) << std::setfill('0') << unit->slice_id
+                   << " of "
+                   << unit->index
+                   << " exited with error: "
+                   << unit->state.error.rdbuf()
+                   << std::endl;
+
+            exit_code = 1;
+        }
+    }
+
+    return exit_code;
+}
+
+// Compares the documents each unit wrote with what the cluster holds for
+// the same slice and filter now.
+int verify_counts(
+    std::vector<std::unique_ptr<work_unit>> & units,
+    int                                       thread_count,
+    dump_options                      const & base,
+    std::ostream                            & errors)
+{
+    run_units(units, thread_count, base, count_unit);
+
+    int     exit_code  = report_errors(units, errors);
+    int64_t total      = 0;
+    int64_t total_live = 0;
+
+    for (auto& unit : units)
+    {
+        total      += unit->state.documents;
+        total_live += std::max<int64_t>(unit->state.live, 0);
+
+        if (unit->state.live >= 0 && unit->state.live != unit->state.documents)
+        {
+            errors << "Slice "
+                   << std::setw(2) << std::setfill('0') << unit->slice_id
+                   << " of "
+                   << unit->index
+                   << " has "
+                   << unit->state.live
+                   << " documents but "
+                   << unit->state.documents
+                   << " were dumped"
+                   << std::endl;
+
+            exit_code = 1;
+        }
+    }
+
+    errors << "Verified " << units.size() << " slices: "
+           << total << " documents dumped, "
+           << total_live << " in the cluster" << std::endl;
+
+    return exit_code;
+}
+
+std::string to_hex(uint64_t value)
+{
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << value;
+    return ss.str();
+}
+
+// The manifest records what every unit of a dump wrote, so the dump can
+// be verified later on without the process that wrote it.
+bool write_manifest(
+    std::string                              const& path,
+    std::vector<std::unique_ptr<work_unit>>  const& units,
+    std::ostream                                  & errors)
+{
+    rapidjson::StringBuffer buffer;
+    json_writer             writer(buffer);
+    int64_t                 documents = 0;
+    uint64_t                checksum  = 0;
+
+    writer.StartObject();
+    writer.Key("units");
+    writer.StartArray();
+
+    for (auto const& unit : units)
+    {
+        documents += unit->state.documents;
+        checksum  += unit->state.checksum;
+
+        writer.StartObject();
+        writer.Key("index");
+        writer.String(unit->index.c_str());
+        writer.Key("slice");
+        writer.Int(unit->slice_id);
+        writer.Key("max");
+        writer.Int(unit->slice_max);
+        writer.Key("shard");
+        writer.Int(unit->shard);
+        writer.Key("filter");
+        writer.String(unit->filter.c_str());
+        writer.Key("documents");
+        writer.Int64(unit->state.documents);
+        writer.EndObject();
+    }
+
+    writer.EndArray();
+    writer.Key("documents");
+    writer.Int64(documents);
+    writer.Key("checksum");
+    writer.String(to_hex(checksum).c_str());
+    writer.EndObject();
+
+    std::ofstream file(path, std::ios::binary);
+    file << buffer.GetString() << '\n';
+
+    if (!file)
+    {
+        errors << "Could not write manifest " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Counts and checksums the records of a dump in [begin, end). NDJSON
+// records are lines, binary records are the payloads after each prefix,
+// the same bytes the dump checksummed when writing them. A binary record
+// that runs past the end stops the walk, with its offset left in `corrupt`.
+void digest_range(
+    uint8_t const* data,
+    size_t         begin,
+    size_t         end,
+    int            format,
+    int64_t      * records,
+    uint64_t     * checksum,
+    size_t       * corrupt)
+{
+    size_t pos = begin;
+
+    while (pos < end)
+    {
+        size_t length;
+        size_t next;
+
+        if (format == FORMAT_NDJSON)
+        {
+            auto const* line_end = static_cast<uint8_t const*>(memchr(data + pos, '\n', end - pos));
+
+            length = (line_end == nullptr ? end : line_end - data) - pos;
+            next   = pos + length + 1;
+        }
+        else
+        {
+            if (end - pos < 4 || end - pos - 4 < record_length(data + pos))
+            {
+                *corrupt = pos;
+                return;
+            }
+
+            length = record_length(data + pos);
+            pos   += 4;
+            next   = pos + length;
+        }
+
+        *checksum += hash_id(reinterpret_cast<char const*>(data + pos), length);
+        *records  += 1;
+        pos        = next;
+    }
+}
+
+// Checks that a manifest has every member verify_dump reads, with the
+// types write_manifest gives them.
+bool valid_manifest(rapidjson::Value const& manifest)
+{
+    auto has = [](rapidjson::Value const& object, char const* name, bool (rapidjson::Value::*is)() const)
+    {
+        return object.HasMember(name) && (object[name].*is)();
+    };
+
+    if (!manifest.IsObject()
+        || !has(manifest, "documents", &rapidjson::Value::IsInt64)
+        || !has(manifest, "checksum", &rapidjson::Value::IsString)
+        || !has(manifest, "units", &rapidjson::Value::IsArray))
+    {
+        return false;
+    }
+
+    for (auto const& unit : manifest["units"].GetArray())
+    {
+        if (!unit.IsObject()
+            || !has(unit, "index", &rapidjson::Value::IsString)
+            || !has(unit, "slice", &rapidjson::Value::IsInt)
+            || !has(unit, "max", &rapidjson::Value::IsInt)
+            || !has(unit, "shard", &rapidjson::Value::IsInt)
+            || !has(unit, "filter", &rapidjson::Value::IsString)
+            || !has(unit, "documents", &rapidjson::Value::IsInt64))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Checks a dump file against its manifest and the cluster. The file is
+// checksummed in one chunk per thread, and the slice counts are fetched
+// from the cluster on the worker pool.
+int verify_dump(
+    std::string const& dump_path,
+    std::string const& manifest_path,
+    job_options const& options)
+{
+    int thread_count = std::max(options.threads > 0 ? options.threads : options.slices, 1);
+
+    dump_options base;
+    base.host  = options.host;
+    base.auth  = options.auth;
+    base.retry = options.retry;
+
+    std::ifstream manifest_file(manifest_path, std::ios::binary);
+    std::string   contents(
+        (std::istreambuf_iterator<char>(manifest_file)),
+        std::istreambuf_iterator<char>());
+
+    rapidjson::Document manifest;
+    manifest.Parse(contents.data(), contents.size());
+
+    if (!manifest_file || manifest.HasParseError() || !valid_manifest(manifest))
+    {
+        std::cerr << "Could not read manifest " << manifest_path << std::endl;
+        return 1;
+    }
+
+    std::ifstream dump_file(dump_path, std::ios::binary);
+    int           format;
+
+    if (!dump_file || !read_dump_header(dump_file, &format))
+    {
+        std::cerr << "Could not open dump " << dump_path << std::endl;
+        return 1;
+    }
+
+    dump_file.close();
+
+    size_t header_size = format == FORMAT_NDJSON ? 0 : sizeof(binary_header);
+    int    fd          = open(dump_path.c_str(), O_RDONLY);
+
+    struct stat st;
+    fstat(fd, &st);
+
+    size_t size   = st.st_size;
+    void*  mapped = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "Could not map dump " << dump_path << std::endl;
+        return 1;
+    }
+
+    auto const* data = static_cast<uint8_t const*>(mapped);
+
+    // Cut the file in chunks on record boundaries. Binary records are
+    // walked by their length prefixes, which only touches the prefixes.
+    std::vector<size_t> bounds = { header_size };
+    size_t              chunk  = std::max<size_t>(1, (size - header_size) / thread_count);
+
+    while (bounds.back() < size)
+    {
+        size_t next = bounds.back() + chunk;
+
+        if (next >= size)
+        {
+            next = size;
+        }
+        else if (format == FORMAT_NDJSON)
+        {
+            auto const* line_end = static_cast<uint8_t const*>(memchr(data + next, '\n', size - next));
+            next = line_end == nullptr ? size : line_end - data + 1;
+        }
+        else
+        {
+            size_t pos = bounds.back();
+
+            while (pos < next && size - pos >= 4 && size - pos - 4 >= record_length(data + pos))
+            {
+                pos += 4 + record_length(data + pos);
+            }
+
+            // A record cut short ends the walk, and is left for the last
+            // chunk to report.
+            next = pos < next ? size : pos;
+        }
+
+        bounds.push_back(next);
+    }
+
+    std::vector<int64_t>     records(bounds.size(), 0);
+    std::vector<uint64_t>    checksums(bounds.size(), 0);
+    std::vector<size_t>      corrupt(bounds.size(), SIZE_MAX);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i + 1 < bounds.size(); i++)
+    {
+        threads.push_back(std::thread(
+            digest_range,
+            data,
+            bounds[i],
+            bounds[i + 1],
+            format,
+            &records[i],
+            &checksums[i],
+            &corrupt[i]));
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (mapped != nullptr)
+    {
+        munmap(mapped, size);
+    }
+
+    int64_t  documents = 0;
+    uint64_t checksum  = 0;
+    size_t   truncated = SIZE_MAX;
+
+    for (size_t i = 0; i < bounds.size(); i++)
+    {
+        documents += records[i];
+        checksum  += checksums[i];
+        truncated  = std::min(truncated, corrupt[i]);
+    }
+
+    // NDJSON has two lines per document.
+    if (format == FORMAT_NDJSON)
+    {
+        documents /= 2;
+    }
+
+    int exit_code = 0;
+
+    if (truncated != SIZE_MAX)
+    {
+        std::cerr << "Dump is corrupt or truncated at offset " << truncated << std::endl;
+        exit_code = 1;
+    }
+    else
+    {
+        if (documents != manifest["documents"].GetInt64())
+        {
+            std::cerr << "Dump has " << documents << " documents, manifest has "
+                      << manifest["documents"].GetInt64() << std::endl;
+            exit_code = 1;
+        }
+
+        if (to_hex(checksum) != manifest["checksum"].GetString())
+        {
+            std::cerr << "Dump checksum " << to_hex(checksum) << " does not match manifest checksum "
+                      << manifest["checksum"].GetString() << std::endl;
+            exit_code = 1;
+        }
+    }
+
+    std::vector<std::unique_ptr<work_unit>> units;
+
+    for (auto const& entry : manifest["units"].GetArray())
+    {
+        auto unit             = std::unique_ptr<work_unit>(new work_unit());
+        unit->index           = entry["index"].GetString();
+        unit->slice_id        = entry["slice"].GetInt();
+        unit->slice_max       = entry["max"].GetInt();
+        unit->shard           = entry["shard"].GetInt();
+        unit->filter          = entry["filter"].GetString();
+        unit->docs            = entry["documents"].GetInt64();
+        unit->state.documents = unit->docs;
+
+        units.push_back(std::move(unit));
+    }
+
+    if (verify_counts(units, thread_count, base, std::cerr) != 0)
+    {
+        exit_code = 1;
+    }
+
+    return exit_code;
+}
+
+int dump_mappings(
+    std::string  const& host,
+    std::string  const& index,
+    auth_options const& auth)
+{
+    static char                       write_buffer[WRITE_BUF_SIZE];
+    static rapidjson::FileWriteStream stream(stdout, write_buffer, sizeof(write_buffer));
+
+    CURL                            * crl = curl_easy_init();
+    long                              response_code;
+    rapidjson::Document               doc;
+    std::string                       url = host + "/" + index + "/_mapping";
+    std::string                       error;
+    std::vector<char>                 buffer;
+
+    bool res = get_or_post_data(
+        crl,
+        url,
+        auth,
+        &buffer,
+        &response_code,
+        &error);
+
+    if (!res)
+    {
+        std::cerr << "A HTTP error occured: " << error << std::endl;
+        return 1;
+    }
+
+    doc.Parse(buffer.data(), buffer.size());
+
+    if (doc.HasParseError())
+    {
+        output_parser_error(doc, std::cerr);
+        return 1;
+    }
+
+    rapidjson::Writer<rapidjson::FileWriteStream> writer(stream);
+
+    // Wildcards, aliases and lists return one entry per concrete index.
+    if (doc.HasMember(index.c_str()))
+    {
+        doc[index.c_str()].Accept(writer);
+    }
+    else
+    {
+        doc.Accept(writer);
+    }
+
+    stream.Put('\n');
+    stream.Flush();
+
+    curl_easy_cleanup(crl);
+
+    return 0;
+}
+
+int dump_index_info(
+    std::string  const& host,
+    std::string  const& index,
+    auth_options const& auth)
+{
+    static char                       write_buffer[WRITE_BUF_SIZE];
+    static rapidjson::FileWriteStream stream(stdout, write_buffer, sizeof(write_buffer));
+
+    CURL                            * crl = curl_easy_init();
+    long                              response_code;
+    rapidjson::Document               doc;
+    std::string                       url = host + "/" + index;
+    std::string                       error;
+    std::vector<char>                 buffer;
+
+    bool res = get_or_post_data(
+        crl,
+        url,
+        auth,
+        &buffer,
+        &response_code,
+        &error);
+
+    if (!res)
+    {
+        std::cerr << "A HTTP error occured: " << error << std::endl;
+        return 1;
+    }
+
+    doc.Parse(buffer.data(), buffer.size());
+
+    if (doc.HasParseError())
+    {
+        output_parser_error(doc, std::cerr);
+        return 1;
+    }
+
+    rapidjson::Writer<rapidjson::FileWriteStream> writer(stream);
+
+    // Wildcards, aliases and lists return one entry per concrete index.
+    if (doc.HasMember(index.c_str()))
+    {
+        doc[index.c_str()].Accept(writer);
+    }
+    else
+    {
+        doc.Accept(writer);
+    }
+
+    stream.Put('\n');
+    stream.Flush();
+
+    curl_easy_cleanup(crl);
+
+    return 0;
+}
+
+int run_dump(
+    job_options   const& options,
+    document_sink      * sink)
+{
+    std::ostream& errors = options.errors != nullptr ? *options.errors : std::cerr;
+
+    // Sanity check - see if we have any documents in the index at all.
+    int64_t total_documents = count_documents(options.host, options.index, options.auth, errors);
+
+    if (total_documents <= 0)
+    {
+        errors << "Index is empty - no documents found" << std::endl;
+        return 0;
+    }
+
+    std::vector<index_info> indices;
+
+    if (!resolve_indices(options.host, options.index, options.auth, &indices, errors))
+    {
+        return 1;
+    }
+
+    int slices       = options.slices;
+    int size         = options.size;
+    int thread_count = std::max(options.threads > 0 ? options.threads : slices, 1);
+
+    if (options.pool != nullptr)
+    {
+        thread_count = options.pool->size();
+    }
+
+    std::string const& since_field = options.since_field;
+    bool               incremental = !options.since_state.empty();
+    since_state        since;
+    since_state        since_next;
+
+    if (incremental && !load_since_state(options.since_state, since_field, &since, errors))
+    {
+        return 1;
+    }
+
+    // Split every index in up to --slices units. Indices too small to fill
+    // more than a page or two get fewer slices so they don't hold open a
+    // scroll context each for nothing.
+    std::vector<std::unique_ptr<work_unit>> units;
+
+    for (auto const& info : indices)
+    {
+        if (info.docs <= 0)
+        {
+            continue;
+        }
+
+        int64_t pages      = (info.docs + size - 1) / size;
+        int     slice_max  = static_cast<int>(std::max<int64_t>(1, std::min<int64_t>(slices, pages)));
+
+        if (!incremental)
+        {
+            for (int i = 0; i < slice_max; i++)
+            {
+                auto unit       = std::unique_ptr<work_unit>(new work_unit());
+                unit->index     = info.name;
+                unit->slice_id  = i;
+                unit->slice_max = slice_max;
+                unit->shard     = -1;
+                unit->docs      = info.docs / slice_max;
+
+                units.push_back(std::move(unit));
+            }
+
+            continue;
+        }
+
+        // Incremental dumps fetch everything above the previous mark and up
+        // to the current one. Sequence numbers are only ordered within a
+        // shard, so _seq_no dumps run one unit per shard, up to its global
+        // checkpoint. The refresh after reading the checkpoints makes
+        // everything below them visible to the units. Timestamp marks are
+        // read from the same shard copies the units then scroll, through a
+        // custom preference.
+        bool                     seq_no     = since_field == SEQ_NO_FIELD;
+        int                      parts      = seq_no ? info.shards : 1;
+        auto              const& marks      = since[info.name];
+        auto                   & next       = since_next[info.name];
+        std::string              preference = seq_no ? "" : "blaze-" + std::to_string(std::random_device{}());
+        std::vector<std::string> current(1);
+
+        bool ok = seq_no
+            ? get_global_checkpoints(options.host, info.name, parts, options.auth, &current, errors)
+                && refresh_index(options.host, info.name, options.auth, errors)
+            : get_high_water_mark(options.host, info.name, since_field, preference, options.auth, &current[0], errors);
+
+        if (!ok)
+        {
+            return 1;
+        }
+
+        for (int i = 0; i < parts; i++)
+        {
+            std::string key  = seq_no ? std::to_string(i) : since_field;
+            std::string mark = current[i];
+
+            auto prev = marks.find(key);
+            std::string from = prev == marks.end() ? "" : prev->second;
+
+            if (mark.empty() || mark == from)
+            {
+                if (!from.empty())
+                {
+                    next[key] = from;
+                }
+
+                continue;
+            }
+
+            next[key] = mark;
+
+            for (int j = 0; j < (seq_no ? 1 : slice_max); j++)
+            {
+                auto unit        = std::unique_ptr<work_unit>(new work_unit());
+                unit->index      = info.name;
+                unit->slice_id   = j;
+                unit->slice_max  = seq_no ? 1 : slice_max;
+                unit->shard      = seq_no ? i : -1;
+                unit->preference = preference;
+                unit->docs       = info.docs / (seq_no ? parts : slice_max);
+                unit->filter     = range_filter(since_field, from, mark);
+
+                units.push_back(std::move(unit));
+            }
+        }
+    }
+
+    // A sample is either a fraction ("0.01", "1%") or a number of documents.
+    // Fixed size samples take a little more than the expected fraction and
+    // stop once they have enough.
+    double               sample_fraction = 1;
+    int64_t              sample_count    = 0;
+    std::atomic<int64_t> sample_spare(0);
+
+    if (!options.sample.empty())
+    {
+        if (!parse_sample(options.sample, &sample_fraction, &sample_count))
+        {
+            errors << "Invalid --sample: " << options.sample << std::endl;
+            return 1;
+        }
+
+        if (sample_count > 0 && options.verify)
+        {
+            errors << "--verify can not be used with a fixed size --sample" << std::endl;
+            return 1;
+        }
+
+        if (sample_count > 0)
+        {
+            // Aim a little above the count, by more than the spread of
+            // the random selection, so small samples rarely come out short.
+            sample_fraction = (sample_count * 1.2 + 4 * sqrt(sample_count) + 10) / total_documents;
+
+            // Units get whole shares of the sample in proportion to their
+            // documents, so it doesn't all come from whichever run first.
+            // What the rounding leaves over, and what units could not fill,
+            // goes to any unit that has spent its own share. With more
+            // units than documents to sample, that is all of it.
+            int64_t weight = 0;
+            int64_t given  = 0;
+
+            for (auto const& unit : units)
+            {
+                weight += std::max<int64_t>(unit->docs, 1);
+            }
+
+            for (auto& unit : units)
+            {
+                unit->sample = static_cast<int64_t>(
+                    static_cast<long double>(sample_count) * std::max<int64_t>(unit->docs, 1) / weight);
+                given       += unit->sample;
+            }
+
+            sample_spare = sample_count - given;
+        }
+
+        if (sample_fraction < 1)
+        {
+            for (auto& unit : units)
+            {
+                unit->filter = sample_filter(unit->filter, sample_fraction, options.sample_seed);
+            }
+        }
+    }
+
+    std::unique_ptr<rate_limiter> limiter;
+    rate_limiter                * shared_limiter = options.limiter;
+
+    if (shared_limiter == nullptr
+        && (options.max_docs_per_sec > 0
+        || options.max_bytes_per_sec > 0
+        || options.max_inflight > 0
+        || options.adaptive_throttle))
+    {
+        limiter.reset(new rate_limiter(
+            options.max_docs_per_sec,
+            options.max_bytes_per_sec,
+            options.max_inflight,
+            options.adaptive_throttle));
+
+        shared_limiter = limiter.get();
+    }
+
+    dump_options base;
+    base.host          = options.host;
+    base.auth          = options.auth;
+    base.size          = size;
+    base.include_index = indices.size() > 1;
+    base.limiter       = shared_limiter;
+    base.retry         = options.retry;
+    base.point_in_time = supports_point_in_time(options.host, options.auth);
+    base.sample_spare  = sample_count > 0 ? &sample_spare : nullptr;
+    base.sink          = sink;
+    base.transform     = options.transform;
+    base.pool          = options.pool;
+    base.share         = options.connections != nullptr ? options.connections->share() : nullptr;
+
+    if (options.transform != nullptr)
+    {
+        base.include_index   = base.include_index || options.transform->sets_index();
+        base.include_routing = options.transform->sets_routing();
+    }
+
+    if (!sink->begin(thread_count, errors))
+    {
+        return 1;
+    }
+
+    run_units(units, thread_count, base, dump_unit);
+
+    int exit_code = report_errors(units, errors);
+
+    if (sample_count > 0 && sample_fraction < 1)
+    {
+        int64_t sampled = 0;
+
+        for (auto const& unit : units)
+        {
+            sampled += unit->state.documents;
+        }
+
+        if (sampled < sample_count)
+        {
+            errors << "Warning: the sample has " << sampled << " of " << sample_count
+                   << " documents, the random selection came out short" << std::endl;
+        }
+    }
+
+    if (!sink->finish(errors))
+    {
+        exit_code = 1;
+    }
+
+    if (!options.manifest.empty() && !write_manifest(options.manifest, units, errors))
+    {
+        exit_code = 1;
+    }
+
+    if (options.verify && exit_code == 0 && verify_counts(units, thread_count, base, errors) != 0)
+    {
+        exit_code = 1;
+    }
+
+    // Only move the marks forward when every unit made it, otherwise the
+    // next run would skip what this one failed to fetch. Indices that were
+    // not part of this run keep their marks.
+    if (incremental && exit_code == 0)
+    {
+        for (auto& index : since_next)
+        {
+            since[index.first] = index.second;
+        }
+
+        if (!save_since_state(options.since_state, since_field, since, errors))
+        {
+            exit_code = 1;
+        }
+    }
+
+    return exit_code;
+}
+
+}
@@ -0,0 +1,696 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "../vendor/rapidjson/include/rapidjson/document.h"
+
+#define DEFAULT_SIZE            5000
+#define DEFAULT_SLICES          5
+#define DEFAULT_RETRIES         5
+#define DEFAULT_RETRY_DELAY     500
+#define DEFAULT_RETRY_MAX_DELAY 30000
+#define DEFAULT_SORT_MEMORY     256
+#define DEFAULT_MAX_OPEN_FILES  64
+#define DEFAULT_PARTITION_MEM   64
+#define SEQ_NO_FIELD            "_seq_no"
+
+#define FORMAT_NDJSON           0
+#define FORMAT_CBOR             1
+#define FORMAT_MSGPACK          2
+
+// The Blaze dump engine. Callers are expected to have called
+// curl_global_init before using any of it.
+namespace blaze
+{
+
+struct auth_options
+{
+    std::string type;
+    std::string user;
+    std::string pass;
+    bool insecure;
+};
+
+struct retry_options
+{
+    int  max_retries = DEFAULT_RETRIES;
+    long base_delay  = DEFAULT_RETRY_DELAY;
+    long max_delay   = DEFAULT_RETRY_MAX_DELAY;
+    long timeout     = 0;
+};
+
+// Shared by all slices to keep the load on the cluster predictable. Docs
+// and bytes are token buckets that refill at their configured rate, and
+// pages are paid for once their size is known, so a bucket can go into
+// debt and the next request waits for it to be paid off. In adaptive mode
+// a delay before each request grows when the cluster returns 429 or its
+// `took` times climb, and shrinks again when they recover.
+class rate_limiter
+{
+public:
+    rate_limiter(
+        double docs_per_sec,
+        double bytes_per_sec,
+        int    max_inflight,
+        bool   adaptive)
+        : docs_rate_(docs_per_sec),
+          bytes_rate_(bytes_per_sec),
+          max_inflight_(max_inflight),
+          adaptive_(adaptive),
+          docs_(docs_per_sec),
+          bytes_(bytes_per_sec),
+          inflight_(0),
+          took_avg_(0),
+          took_floor_(0),
+          delay_(0),
+          last_(std::chrono::steady_clock::now())
+    {
+    }
+
+    void acquire()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+
+        cv_.wait(lock, [this] { return max_inflight_ <= 0 || inflight_ < max_inflight_; });
+        inflight_++;
+
+        while (true)
+        {
+            refill();
+
+            double wait = 0;
+
+            if (docs_rate_ > 0 && docs_ < 0)
+            {
+                wait = std::max(wait, -docs_ / docs_rate_);
+            }
+
+            if (bytes_rate_ > 0 && bytes_ < 0)
+            {
+                wait = std::max(wait, -bytes_ / bytes_rate_);
+            }
+
+            if (wait <= 0)
+            {
+                break;
+            }
+
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+            lock.lock();
+        }
+
+        double delay = delay_;
+        lock.unlock();
+
+        if (delay > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::duration<double>(delay));
+        }
+    }
+
+    void release(
+        int64_t docs,
+        int64_t bytes,
+        int64_t took,
+        long    status)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+
+        docs_  -= docs;
+        bytes_ -= bytes;
+        inflight_--;
+
+        if (adaptive_)
+        {
+            adapt(took, status);
+        }
+
+        cv_.notify_one();
+    }
+
+private:
+    void refill()
+    {
+        auto   now     = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - last_).count();
+
+        last_ = now;
+
+        // Allow at most a second worth of burst.
+        docs_  = std::min(docs_rate_,  docs_  + elapsed * docs_rate_);
+        bytes_ = std::min(bytes_rate_, bytes_ + elapsed * bytes_rate_);
+    }
+
+    void adapt(
+        int64_t took,
+        long    status)
+    {
+        if (status == 429 || status == 503)
+        {
+            delay_ = std::min(10.0, std::max(0.1, delay_ * 2));
+            return;
+        }
+
+        if (status != 200)
+        {
+            return;
+        }
+
+        took_avg_   = took_avg_ == 0 ? took : took_avg_ * 0.8 + took * 0.2;
+        took_floor_ = took_floor_ == 0 ? took_avg_ : std::min(took_floor_, took_avg_);
+
+        // Compare against the best the cluster has done during this dump,
+        // with some slack so small pages don't trip it on noise.
+        if (took_avg_ > took_floor_ * 2 + 20)
+        {
+            delay_ = std::min(10.0, std::max(0.05, delay_ * 1.5));
+        }
+        else
+        {
+            delay_ = delay_ < 0.01 ? 0 : delay_ / 2;
+        }
+    }
+
+    double                                docs_rate_;
+    double                                bytes_rate_;
+    int                                   max_inflight_;
+    bool                                  adaptive_;
+    double                                docs_;
+    double                                bytes_;
+    int                                   inflight_;
+    double                                took_avg_;
+    double                                took_floor_;
+    double                                delay_;
+    std::chrono::steady_clock::time_point last_;
+    std::mutex                            mtx_;
+    std::condition_variable               cv_;
+};
+
+// Records of a sorted dump waiting to be spilled as a sorted run. Keys and
+// record bytes share one arena to keep the overhead per record small.
+struct sort_run
+{
+    struct entry
+    {
+        size_t   key;
+        uint32_t key_length;
+        uint32_t length;
+    };
+
+    std::string        arena;
+    std::vector<entry> entries;
+};
+
+struct thread_state
+{
+    std::stringstream error;
+    int64_t           documents = 0;
+    uint64_t          checksum  = 0;
+    int64_t           live      = -1;
+    int               retries   = 0;
+    sort_run          run;
+};
+
+class document_sink;
+class document_transform;
+class worker_pool;
+
+struct dump_options
+{
+    std::string  host;
+    std::string  index;
+    auth_options auth;
+    int          slice_id;
+    int          slice_max;
+    int          size;
+    bool         include_index;
+    bool         include_routing = false;
+    std::string  preference;
+    std::string  filter;
+    rate_limiter * limiter = nullptr;
+    retry_options  retry;
+
+    // Page with a point in time and search_after, which can retry any
+    // page, instead of a scroll.
+    bool point_in_time = false;
+
+    // Documents left for this unit to write when dumping a sample of a
+    // fixed size, and those no unit has claimed, for units whose own share
+    // is spent.
+    int64_t              * sample_budget = nullptr;
+    std::atomic<int64_t> * sample_spare  = nullptr;
+
+    document_sink * sink = nullptr;
+
+    document_transform const* transform = nullptr;
+
+    // Shared with other dumps in the same process when set.
+    worker_pool   * pool  = nullptr;
+    CURLSH        * share = nullptr;
+};
+
+// Receives the hits of every page of every slice. Pages are written from
+// all worker threads at once, so sinks must be safe to call concurrently.
+class document_sink
+{
+public:
+    virtual ~document_sink() {}
+
+    // Called before the first page, with the number of worker threads.
+    // Errors of begin and finish go to `errors`.
+    virtual bool begin(
+        int            threads,
+        std::ostream & errors) { return true; }
+
+    // Called with the first `count` hits of a page.
+    virtual void write_page(
+        rapidjson::Value const* hits,
+        rapidjson::SizeType     count,
+        dump_options     const& options,
+        thread_state          * state) = 0;
+
+    // Called when a slice is done, on the thread that ran it.
+    virtual void finish_unit(thread_state* state) {}
+
+    // Called once all slices are done.
+    virtual bool finish(std::ostream& errors) { return true; }
+};
+
+struct hit
+{
+    char             const* index;
+    char             const* id;
+    rapidjson::SizeType     id_length;
+    rapidjson::Value const& source;
+};
+
+// Hands every hit to a callback as parsed JSON, for in-process consumers
+// that have no use for a serialized dump. The callback is called from all
+// worker threads at once.
+class callback_sink : public document_sink
+{
+public:
+    explicit callback_sink(std::function<void(hit const&)> callback)
+        : callback_(callback)
+    {
+    }
+
+    void write_page(
+        rapidjson::Value const* hits,
+        rapidjson::SizeType     count,
+        dump_options     const& options,
+        thread_state          * state) override
+    {
+        for (rapidjson::SizeType i = 0; i < count; i++)
+        {
+            auto const& id = hits[i]["_id"];
+
+            callback_({
+                hits[i]["_index"].GetString(),
+                id.GetString(),
+                id.GetStringLength(),
+                hits[i]["_source"]
+            });
+        }
+    }
+
+private:
+    std::function<void(hit const&)> callback_;
+};
+
+// One entry in the sidecar index of a dump: the hashed _id of a document
+// and the byte offset of its bulk action line in the dump.
+struct sidecar_entry
+{
+    uint64_t hash;
+    uint64_t offset;
+
+    bool operator<(sidecar_entry const& other) const
+    {
+        return hash < other.hash || (hash == other.hash && offset < other.offset);
+    }
+};
+
+struct output_options
+{
+    int         format      = FORMAT_NDJSON;
+    bool        checksum    = false;
+    std::string sidecar;
+    bool        sorted      = false;
+    size_t      sort_memory = DEFAULT_SORT_MEMORY;
+    std::string sort_dir;
+};
+
+// Writes a dump to a file, as NDJSON in the bulk format or as binary
+// records, along with its sidecar index. Pages are serialized on the
+// worker threads and only the write itself is done under a lock.
+class output_sink : public document_sink
+{
+public:
+    output_sink(
+        FILE                 * file,
+        output_options const & options);
+
+    bool begin(
+        int            threads,
+        std::ostream & errors) override;
+
+    void write_page(
+        rapidjson::Value const* hits,
+        rapidjson::SizeType     count,
+        dump_options     const& options,
+        thread_state          * state) override;
+
+    void finish_unit(thread_state* state) override;
+
+    bool finish(std::ostream& errors) override;
+
+private:
+    void write(
+        char                 const* data,
+        size_t                      size,
+        std::vector<sidecar_entry>& entries);
+
+    void spill_run(
+        sort_run     * run,
+        thread_state * state);
+
+    bool merge_runs(std::ostream& errors);
+
+    FILE                       * file_;
+    output_options               options_;
+    std::mutex                   mtx_;
+    uint64_t                     offset_;
+    std::vector<sidecar_entry>   entries_;
+    size_t                       run_bytes_;
+    std::vector<std::string>     runs_;
+};
+
+// Rewrites every hit before it is written, as configured by a JSON spec:
+// source fields to drop, rename or set, and templates for the _id, target
+// index and routing of the bulk action. A template takes {field} from the
+// source, or {_id} and {_index} from the hit, and sees the document as it
+// was before the other changes. A template with a field a document lacks
+// leaves that document's value as it was.
+class document_transform
+{
+public:
+    bool load(std::string const& path);
+
+    bool sets_index() const { return !index_.empty(); }
+
+    bool sets_routing() const { return !routing_.empty(); }
+
+    void apply(
+        rapidjson::Value                   & hit,
+        rapidjson::Document::AllocatorType & allocator) const;
+
+private:
+    typedef std::vector<std::string> path;
+
+    // Literal text, or a field when the path is not empty.
+    struct part
+    {
+        std::string text;
+        path        field;
+    };
+
+    typedef std::vector<part> format;
+
+    static bool parse_template(
+        std::string const& text,
+        format           * out);
+
+    static bool render(
+        format      const& tmpl,
+        rapidjson::Value & hit,
+        std::string      * out);
+
+    rapidjson::Document                                   spec_;
+    std::vector<path>                                     drop_;
+    std::vector<std::pair<path, path>>                    rename_;
+    std::vector<std::pair<path, rapidjson::Value const*>> set_;
+    format                                                id_;
+    format                                                index_;
+    format                                                routing_;
+};
+
+struct partition_options
+{
+    std::string field;
+    std::string date_format;
+    std::string dir            = ".";
+    int         max_open_files = DEFAULT_MAX_OPEN_FILES;
+    size_t      max_memory     = DEFAULT_PARTITION_MEM;
+};
+
+// Writes every document to the file of its partition, named after the
+// value of a source field, or that value formatted as a date when a date
+// format is given. Records are buffered per partition and written out in
+// blocks, and only the most recently written files are kept open. When
+// the buffers of all partitions together go past `max_memory` MB, the
+// largest are written out early.
+class partition_sink : public document_sink
+{
+public:
+    partition_sink(
+        output_options    const& output,
+        partition_options const& options);
+
+    ~partition_sink();
+
+    bool begin(
+        int            threads,
+        std::ostream & errors) override;
+
+    void write_page(
+        rapidjson::Value const* hits,
+        rapidjson::SizeType     count,
+        dump_options     const& options,
+        thread_state          * state) override;
+
+    bool finish(std::ostream& errors) override;
+
+private:
+    struct partition
+    {
+        std::string path;
+        std::string buffer;
+        FILE      * file    = nullptr;
+        bool        created = false;
+    };
+
+    std::string partition_name(rapidjson::Value const& hit) const;
+
+    bool flush(partition* part);
+
+    output_options                   output_;
+    partition_options                options_;
+    std::vector<std::string>         field_;
+    std::mutex                       mtx_;
+    std::map<std::string, partition> partitions_;
+    std::list<partition*>            open_;
+    size_t                           buffered_;
+};
+
+struct index_info
+{
+    std::string name;
+    int64_t     docs;
+    int         shards;
+};
+
+struct work_unit
+{
+    std::string  index;
+    int          slice_id;
+    int          slice_max;
+    int          shard;
+    int64_t      docs;
+    std::string  filter;
+    thread_state state;
+
+    // Pins the unit to the shard copies its high-water mark was read from.
+    std::string  preference;
+
+    // This unit's share of a sample of a fixed size, or -1.
+    int64_t      sample = -1;
+};
+
+typedef void (*unit_job)(dump_options const&, work_unit*);
+
+// A fixed set of worker threads for running the units of many dumps at
+// once, so the number of slices running in a process stays bounded no
+// matter how many dumps it runs. Workers go round the dumps with units
+// left and take one from each in turn.
+class worker_pool
+{
+public:
+    explicit worker_pool(int threads);
+    ~worker_pool();
+
+    int size() const { return static_cast<int>(threads_.size()); }
+
+    // Runs `job` for every unit, returning once all of them are done.
+    void run(
+        std::vector<work_unit*> const& units,
+        dump_options            const& base,
+        unit_job                       job);
+
+private:
+    struct batch;
+
+    void work();
+
+    std::mutex               mtx_;
+    std::condition_variable  cv_;
+    std::deque<batch*>       batches_;
+    bool                     stop_;
+    std::vector<std::thread> threads_;
+};
+
+// A curl share handle for the connection cache, DNS cache and TLS sessions,
+// so units of different dumps reuse each other's connections.
+class connection_pool
+{
+public:
+    connection_pool();
+    ~connection_pool();
+
+    CURLSH* share() const { return share_; }
+
+private:
+    static void lock(
+        CURL             * handle,
+        curl_lock_data     data,
+        curl_lock_access   access,
+        void             * pool);
+
+    static void unlock(
+        CURL           * handle,
+        curl_lock_data   data,
+        void           * pool);
+
+    CURLSH*    share_;
+    std::mutex mtx_[CURL_LOCK_DATA_LAST];
+};
+
+// Everything a dump is run with, apart from where its output goes.
+struct job_options
+{
+    std::string   host;
+    std::string   index;
+    auth_options  auth;
+    int           slices            = DEFAULT_SLICES;
+    int           size              = DEFAULT_SIZE;
+    int           threads           = 0;
+    std::string   since_state;
+    std::string   since_field       = SEQ_NO_FIELD;
+    std::string   sample;
+    int64_t       sample_seed       = 1;
+    double        max_docs_per_sec  = 0;
+    double        max_bytes_per_sec = 0;
+    int           max_inflight      = 0;
+    bool          adaptive_throttle = false;
+    retry_options retry;
+    bool          verify            = false;
+    std::string   manifest;
+
+    document_transform const* transform = nullptr;
+
+    // Where errors of the dump are reported, std::cerr when not set.
+    std::ostream * errors = nullptr;
+
+    // Resources shared with other dumps. The limiter, when set, is used
+    // instead of one built from the options above.
+    worker_pool     * pool        = nullptr;
+    rate_limiter    * limiter     = nullptr;
+    connection_pool * connections = nullptr;
+};
+
+// Reads an output format name: ndjson, cbor or msgpack.
+bool parse_format(
+    std::string const& name,
+    int              * format);
+
+// Reads a --sample value: either a fraction of the documents ("0.01", "1%")
+// above 0 and at most 1, or a whole number of documents of at least 1.
+// Sets `count` to 0 for a fraction and `fraction` to 1 for a count.
+bool parse_sample(
+    std::string const& text,
+    double           * fraction,
+    int64_t          * count);
+
+bool get_or_post_data(
+    CURL                * crl,
+    std::string   const & url,
+    auth_options  const & auth,
+    std::vector<char>   * data,
+    long                * response_code,
+    std::string         * error,
+    std::string           body = "",
+    char          const * method = nullptr);
+
+void dump(
+    dump_options const& options,
+    thread_state      * state);
+
+int64_t count_documents(
+    std::string  const& host,
+    std::string  const& index,
+    auth_options const& auth,
+    std::ostream      & errors);
+
+bool resolve_indices(
+    std::string             const& host,
+    std::string             const& expression,
+    auth_options            const& auth,
+    std::vector<index_info>      * indices,
+    std::ostream                 & errors);
+
+// Dumps the indices matching `options.index` to `sink`, slicing them and
+// running the slices on a pool of worker threads. Returns the exit code.
+int run_dump(
+    job_options   const& options,
+    document_sink      * sink);
+
+int verify_dump(
+    std::string const& dump_path,
+    std::string const& manifest_path,
+    job_options const& options);
+
+int lookup_documents(
+    std::string              const& dump_path,
+    std::string              const& sidecar_path,
+    std::vector<std::string> const& ids);
+
+int convert_dump(std::string const& path);
+
+int dump_mappings(
+    std::string  const& host,
+    std::string  const& index,
+    auth_options const& auth);
+
+int dump_index_info(
+    std::string  const& host,
+    std::string  const& index,
+    auth_options const& auth);
+
+}
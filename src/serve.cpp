@@ -0,0 +1,577 @@
+#include "serve.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../vendor/rapidjson/include/rapidjson/stringbuffer.h"
+#include "../vendor/rapidjson/include/rapidjson/writer.h"
+
+#define PROGRESS_INTERVAL 1000
+
+// Writing to a peer that went away must not kill the process with SIGPIPE.
+// Linux takes a flag on every send, macOS an option on the socket.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS        MSG_NOSIGNAL
+#else
+#define SEND_FLAGS        0
+#endif
+
+// Everything the jobs of a server share.
+struct server
+{
+    blaze::job_options       defaults;
+    blaze::worker_pool     * pool;
+    blaze::connection_pool * connections;
+    blaze::rate_limiter    * limiter;
+    std::atomic<int64_t>     next_job;
+};
+
+// Counts the documents going through to another sink, for progress
+// reports.
+class progress_sink : public blaze::document_sink
+{
+public:
+    explicit progress_sink(blaze::document_sink* inner)
+        : inner_(inner),
+          documents_(0)
+    {
+    }
+
+    bool begin(
+        int            threads,
+        std::ostream & errors) override
+    {
+        return inner_->begin(threads, errors);
+    }
+
+    void write_page(
+        rapidjson::Value    const* hits,
+        rapidjson::SizeType        count,
+        blaze::dump_options const& options,
+        blaze::thread_state      * state) override
+    {
+        inner_->write_page(hits, count, options, state);
+        documents_ += count;
+    }
+
+    void finish_unit(blaze::thread_state* state) override
+    {
+        inner_->finish_unit(state);
+    }
+
+    bool finish(std::ostream& errors) override
+    {
+        return inner_->finish(errors);
+    }
+
+    int64_t documents() const
+    {
+        return documents_.load();
+    }
+
+private:
+    blaze::document_sink* inner_;
+    std::atomic<int64_t>  documents_;
+};
+
+bool read_line(
+    int           fd,
+    std::string * line)
+{
+    char c;
+
+    while (recv(fd, &c, 1, 0) == 1)
+    {
+        if (c == '\n')
+        {
+            return true;
+        }
+
+        line->push_back(c);
+    }
+
+    return !line->empty();
+}
+
+void send_line(
+    int                            fd,
+    rapidjson::StringBuffer const& buffer)
+{
+    std::string line(buffer.GetString(), buffer.GetSize());
+    line.push_back('\n');
+
+    // The job carries on when its client has gone away.
+    send(fd, line.data(), line.size(), SEND_FLAGS);
+}
+
+void ignore_sigpipe(int fd)
+{
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+    (void) fd;
+#endif
+}
+
+void send_status(
+    int                 fd,
+    int64_t             job,
+    std::string const & index,
+    int64_t             documents,
+    int                 exit_code,
+    std::string const & error)
+{
+    rapidjson::StringBuffer                    buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+
+    writer.StartObject();
+    writer.Key("job");
+    writer.Int64(job);
+
+    if (!index.empty())
+    {
+        writer.Key("index");
+        writer.String(index.c_str());
+    }
+
+    writer.Key("documents");
+    writer.Int64(documents);
+
+    if (!error.empty())
+    {
+        writer.Key("error");
+        writer.String(error.c_str());
+    }
+
+    if (exit_code >= 0)
+    {
+        writer.Key("exit_code");
+        writer.Int(exit_code);
+    }
+
+    writer.EndObject();
+
+    send_line(fd, buffer);
+}
+
+// Reads the options of a job. They are the command line options of a dump,
+// without the leading dashes, plus the path to write the dump to.
+bool parse_job(
+    std::map<std::string, std::string> const& args,
+    blaze::job_options                      * options,
+    blaze::output_options                   * output,
+    blaze::document_transform               * transform,
+    std::string                             * path,
+    std::string                             * error)
+{
+    for (auto const& arg : args)
+    {
+        auto const& key   = arg.first;
+        auto const& value = arg.second;
+
+        try
+        {
+            if (key == "index")
+            {
+                options->index = value;
+            }
+            else if (key == "output")
+            {
+                *path = value;
+            }
+            else if (key == "slices")
+            {
+                options->slices = std::stoi(value);
+            }
+            else if (key == "size")
+            {
+                options->size = std::stoi(value);
+            }
+            else if (key == "since-state")
+            {
+                options->since_state = value;
+            }
+            else if (key == "since-field")
+            {
+                options->since_field = value;
+            }
+            else if (key == "sample")
+            {
+                double  fraction;
+                int64_t count;
+
+                if (!blaze::parse_sample(value, &fraction, &count))
+                {
+                    *error = "Invalid value for sample: " + value;
+                    return false;
+                }
+
+                options->sample = value;
+            }
+            else if (key == "sample-seed")
+            {
+                options->sample_seed = std::stoll(value);
+            }
+            else if (key == "verify")
+            {
+                options->verify = value == "true";
+            }
+            else if (key == "manifest")
+            {
+                options->manifest = value;
+            }
+            else if (key == "sidecar")
+            {
+                output->sidecar = value;
+            }
+            else if (key == "sorted")
+            {
+                output->sorted = value == "true";
+            }
+            else if (key == "sort-memory")
+            {
+                output->sort_memory = std::stoul(value);
+            }
+            else if (key == "sort-dir")
+            {
+                output->sort_dir = value;
+            }
+            else if (key == "transform")
+            {
+                if (!transform->load(value))
+                {
+                    *error = "Could not read transform " + value;
+                    return false;
+                }
+
+                options->transform = transform;
+            }
+            else if (key == "format")
+            {
+                if (!blaze::parse_format(value, &output->format))
+                {
+                    *error = "Unknown output format: " + value;
+                    return false;
+                }
+            }
+            else
+            {
+                *error = "Unknown job option: " + key;
+                return false;
+            }
+        }
+        catch (std::exception const&)
+        {
+            *error = "Invalid value for " + key + ": " + value;
+            return false;
+        }
+    }
+
+    if (options->index.empty() || path->empty())
+    {
+        *error = "Must provide an index and an output";
+        return false;
+    }
+
+    output->checksum = !options->manifest.empty();
+
+    if (output->sorted && output->sort_dir.empty())
+    {
+        char const* tmp = getenv("TMPDIR");
+        output->sort_dir = tmp != nullptr ? tmp : "/tmp";
+    }
+
+    return true;
+}
+
+// Runs the job sent on a connection, reporting its progress back on it
+// every PROGRESS_INTERVAL milliseconds until it is done.
+void run_job(
+    server * srv,
+    int      fd)
+{
+    int64_t     id = ++srv->next_job;
+    std::string line;
+    std::string error;
+
+    std::map<std::string, std::string> args;
+    rapidjson::Document                request;
+
+    if (!read_line(fd, &line))
+    {
+        close(fd);
+        return;
+    }
+
+    request.Parse(line.data(), line.size());
+
+    if (request.HasParseError() || !request.IsObject())
+    {
+        error = "A job must be a JSON object on one line";
+    }
+    else
+    {
+        for (auto it = request.MemberBegin(); it != request.MemberEnd(); ++it)
+        {
+            if (!it->value.IsString())
+            {
+                error = std::string("Job options must be strings: ") + it->name.GetString();
+                break;
+            }
+
+            args[it->name.GetString()] = it->value.GetString();
+        }
+    }
+
+    blaze::job_options    options = srv->defaults;
+    blaze::output_options output;
+    std::string           path;
+
+    options.pool        = srv->pool;
+    options.limiter     = srv->limiter;
+    options.connections = srv->connections;
+
+    blaze::document_transform transform;
+    FILE*                     file = nullptr;
+
+    if (error.empty() && parse_job(args, &options, &output, &transform, &path, &error))
+    {
+        file = fopen(path.c_str(), "wb");
+
+        if (file == nullptr)
+        {
+            error = "Could not open " + path + ": " + strerror(errno);
+        }
+    }
+
+    if (file == nullptr)
+    {
+        std::cerr << "Job " << id << " rejected: " << error << std::endl;
+        send_status(fd, id, options.index, 0, 1, error);
+        close(fd);
+        return;
+    }
+
+    std::cerr << "Job " << id << ": dumping " << options.index << " to " << path << std::endl;
+
+    blaze::output_sink out(file, output);
+    progress_sink      sink(&out);
+
+    std::mutex              mtx;
+    std::condition_variable cv;
+    bool                    done      = false;
+    int                     exit_code = 1;
+    std::stringstream       errors;
+
+    options.errors = &errors;
+
+    std::thread runner([&]
+    {
+        int code = blaze::run_dump(options, &sink);
+
+        std::unique_lock<std::mutex> lock(mtx);
+        exit_code = code;
+        done      = true;
+        cv.notify_one();
+    });
+
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        while (!cv.wait_for(lock, std::chrono::milliseconds(PROGRESS_INTERVAL), [&done] { return done; }))
+        {
+            send_status(fd, id, options.index, sink.documents(), -1, "");
+        }
+    }
+
+    runner.join();
+
+    if (fclose(file) != 0)
+    {
+        exit_code = 1;
+    }
+
+    error = errors.str();
+
+    if (!error.empty() && error.back() == '\n')
+    {
+        error.pop_back();
+    }
+
+    if (!error.empty())
+    {
+        std::cerr << "Job " << id << ": " << error << std::endl;
+    }
+
+    std::cerr << "Job " << id << ": " << sink.documents() << " documents, exit code " << exit_code << std::endl;
+
+    // What a successful job reports, such as the summary of --verify, is
+    // not an error.
+    send_status(fd, id, options.index, sink.documents(), exit_code, exit_code != 0 ? error : "");
+    close(fd);
+}
+
+bool socket_address(
+    std::string const& path,
+    sockaddr_un      * addr)
+{
+    if (path.size() >= sizeof(addr->sun_path))
+    {
+        std::cerr << "Socket path is too long: " << path << std::endl;
+        return false;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+
+    return true;
+}
+
+int serve(
+    std::string        const& socket_path,
+    blaze::job_options const& defaults)
+{
+    sockaddr_un addr;
+
+    if (!socket_address(socket_path, &addr))
+    {
+        return 1;
+    }
+
+    int         fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct stat st;
+
+    // A socket left behind by an earlier server would fail the bind. Only
+    // ever remove a socket, never whatever else the path might name.
+    if (lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(socket_path.c_str());
+    }
+
+    if (fd < 0
+        || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0)
+    {
+        std::cerr << "Could not listen on " << socket_path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    blaze::worker_pool                   pool(std::max(defaults.threads, 1));
+    blaze::connection_pool               connections;
+    std::unique_ptr<blaze::rate_limiter> limiter;
+
+    if (defaults.max_docs_per_sec > 0
+        || defaults.max_bytes_per_sec > 0
+        || defaults.max_inflight > 0
+        || defaults.adaptive_throttle)
+    {
+        limiter.reset(new blaze::rate_limiter(
+            defaults.max_docs_per_sec,
+            defaults.max_bytes_per_sec,
+            defaults.max_inflight,
+            defaults.adaptive_throttle));
+    }
+
+    server srv;
+    srv.defaults    = defaults;
+    srv.pool        = &pool;
+    srv.connections = &connections;
+    srv.limiter     = limiter.get();
+    srv.next_job    = 0;
+
+    std::cerr << "Listening on " << socket_path << " with " << pool.size() << " workers" << std::endl;
+
+    while (true)
+    {
+        int client = accept(fd, nullptr, nullptr);
+
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            // Jobs still running hold on to the pools, so don't unwind.
+            std::cerr << "Could not accept on " << socket_path << ": " << strerror(errno) << std::endl;
+            _exit(1);
+        }
+
+        ignore_sigpipe(client);
+
+        std::thread(run_job, &srv, client).detach();
+    }
+}
+
+int submit(
+    std::string                        const& socket_path,
+    std::map<std::string, std::string> const& args)
+{
+    sockaddr_un addr;
+
+    if (!socket_address(socket_path, &addr))
+    {
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        std::cerr << "Could not connect to " << socket_path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    ignore_sigpipe(fd);
+
+    rapidjson::StringBuffer                    buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+
+    writer.StartObject();
+
+    for (auto const& arg : args)
+    {
+        writer.Key(arg.first.c_str());
+        writer.String(arg.second.c_str());
+    }
+
+    writer.EndObject();
+
+    send_line(fd, buffer);
+
+    int         exit_code = 1;
+    std::string line;
+
+    while (read_line(fd, &line))
+    {
+        rapidjson::Document status;
+        status.Parse(line.data(), line.size());
+
+        std::cerr << line << std::endl;
+        line.clear();
+
+        if (!status.HasParseError() && status.IsObject() && status.HasMember("exit_code"))
+        {
+            exit_code = status["exit_code"].GetInt();
+            break;
+        }
+    }
+
+    close(fd);
+
+    return exit_code;
+}
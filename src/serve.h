@@ -0,0 +1,20 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "libblaze.h"
+
+// Runs dump jobs sent over a Unix socket on one shared worker pool,
+// connection pool and rate limiter. Jobs take host, auth, retry and
+// throttling settings from `defaults`, and the pool has `defaults.threads`
+// workers. Only returns when the socket fails.
+int serve(
+    std::string        const& socket_path,
+    blaze::job_options const& defaults);
+
+// Sends a job to a running `blaze serve` and waits for it, printing its
+// progress to stderr. Returns the exit code of the job.
+int submit(
+    std::string                        const& socket_path,
+    std::map<std::string, std::string> const& args);